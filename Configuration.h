@@ -31,6 +31,76 @@ Licence: GPL
                              // not displayed; \f and \n should be supported.
 #define HOST_MESSAGE 'H' // Type byte of a message that is to be sent to the host; the H is not sent.
 
+// How serious a message is.  Messages are logged in RAM and written to the message file in
+// blocks when things are quiet.
+
+#define LOG_INFO 0
+#define LOG_WARNING 1
+#define LOG_ERROR 2
+#define LOG_LENGTH 2048 // Bytes of messages kept in RAM - a power of 2
+#define LOG_FLUSH_DELAY 200000 // Microseconds with no new messages before they are written to the file
+#define LOG_RETRY_DELAY 10000000 // Microseconds before trying the file again when it couldn't be opened
+
+// Scheduler stuff.  RepRap::Spin() runs the periodic tasks when they are due and the others when
+// they have something to do, highest priority first, so motion and heating are never kept waiting
+// behind the G Code interpreter or the web server.
+
+#define TASKS 5
+#define PLATFORM_TASK 0
+#define MOVE_TASK 1
+#define HEAT_TASK 2
+#define GCODES_TASK 3
+#define WEB_TASK 4
+#define TASK_NAMES {"Platform", "Move", "Heat", "GCodes", "Webserver"}
+#define TASK_PERIODS {TEMP_SAMPLE_INTERVAL, MOVE_TICK, (unsigned long)(1000000.0*TEMP_INTERVAL), 0, 0} // Microseconds; 0 means whenever there's work
+#define TASK_PRIORITIES {2, 0, 1, 3, 4} // Lower numbers run first
+#define TASK_BUDGETS {1000, 300, 1000, 2000, 5000} // Microseconds a task should take at most
+
+// How long each task, the step interrupt and each pass of the main loop take is recorded
+// in a histogram of processor cycles with buckets for successive powers of 2.
+
+#define INTERRUPT_PROFILE TASKS
+#define LOOP_PROFILE (TASKS + 1)
+#define PROFILES (TASKS + 2)
+#define PROFILE_BUCKETS 24 // The last bucket (2^22 cycles and up) takes everything longer
+#define PROFILE_STRING_LENGTH 300
+
+// Movement stuff
+
+#define LOOK_AHEAD 16 // The number of moves the planner can hold for look-ahead
+#define MOVE_TICK 300 // Microseconds between checks for the next move to start
+#define DDA_RING_LENGTH 3 // Moves committed to the step generator (one fewer than this can be waiting)
+#define DDA_START_INTERVAL 100 // Microseconds from starting the step interrupt to the first step
+#define BED_GRID 5 // Points probed along each of X and Y to map the bed
+
+// Heater stuff
+
+#define BED_HEATER 0 // Heaters are numbered with the bed first...
+#define E0_HEATER 1 // ...then the extruders
+#define TEMP_CLOSE_ENOUGH 1.0 // Degrees from the target that count as being at temperature
+#define AUTOTUNE_CYCLES 5 // Default number of oscillations an autotune measures
+#define AUTOTUNE_TIMEOUT 1200.0 // Seconds before an autotune gives up
+
+// G Code stuff
+
+#define GCODE_LETTER_COUNT 26 // A to Z
+#define INCH 25.4 // mm
+#define COMMAND_QUEUE_LENGTH 16 // Lines of G Code waiting to be interpreted...
+#define INTERACTIVE_LINES 4 // ...of which a file being printed may not take the last few, so the web and serial line can always get in
+#define GCODE_BATCH 8 // Most lines interpreted per GCodes::Spin()
+#define ARC_TOLERANCE 0.01 // mm - the furthest the chords of a G2/G3 arc may stray from it
+#define ARC_CORRECTION 16 // Chords between exact recalculations of an arc's rotation
+#define SIDECAR_LINES 128 // Line starts recorded in a G Code file's sidecar index...
+#define SIDECAR_LAYERS 256 // ...and layer starts
+#define SIDECAR_MAGIC 0x52524731 // "RRG1" - change it whenever SidecarData changes
+
+// Where lines of G Code come from
+
+#define WEB_SOURCE 0
+#define SERIAL_SOURCE 1
+#define FILE_SOURCE 2
+#define COMMAND_SOURCES 3
+#define NO_FILE_OFFSET 0xFFFFFFFF // The file offset of lines and moves that aren't from a file being printed
 
 // Webserver stuff
 
@@ -39,18 +109,29 @@ Licence: GPL
 #define DEFAULT_NAME "My RepRap 1"
 
 #define CLIENT_CLOSE_DELAY 1000 // Microseconds to wait after serving a page
+#define KEEP_ALIVE_TIMEOUT 5000000 // Microseconds an idle connection is kept open
+#define WEB_SPIN_BYTES 256 // Most bytes of a page read from its file in one Webserver::Spin()
+#define UPLOAD_SPIN_BYTES 2048 // Most bytes of an uploaded file taken from the client in one Webserver::Spin()
 
 #define PASSWORD_PAGE "passwd.php"
 #define INDEX_PAGE "control.php"
 #define PRINT_PAGE "print.php"
 #define MESSAGE_FILE "messages.php"
 #define MESSAGE_TEMPLATE "messages.txt"
+#define STATUS_PAGE "status.json" // Made in RAM for programs that poll the machine; there's no such file
+#define STATUS_JSON_LENGTH 1024 // Most bytes in it...
+#define STATUS_LOG_LENGTH 256 // ...of which the tail of the message log takes at most this (before escaping)
 #define STRING_LENGTH 1000
 #define PHP_TAG_LENGTH 200
 #define POST_LENGTH 200
+#define STATUS_LENGTH 100
 #define PHP_IF 1
 #define PHP_ECHO 2
 #define PHP_PRINT 3
+#define PHP_TEXT 4
 #define NO_PHP 99
+#define PHP_TEMPLATES 4 // .php pages kept compiled
+#define PHP_OPS 32 // Most operations in a compiled page; bigger pages are interpreted every time
+#define PHP_DISPATCH 16 // Size of the hash table for PHP function names - a power of 2
 
 #endif
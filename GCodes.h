@@ -22,27 +22,439 @@ Licence: GPL
 #ifndef GCODES_H
 #define GCODES_H
 
+// One line of G Code parsed in a single pass over the string where it lies, with no copying.
+// Each letter that appears has its value stored in the slot for that letter, so finding a value
+// costs an array look-up.  Commands that take a string (like a file name) stop the parse, and
+// the string is left where it is for String() to point to.
+
+class GCodeRecord
+{
+  public:
+
+    GCodeRecord();
+    boolean Parse(char* line); // Returns false if the line has a bad checksum
+    boolean Seen(char letter);
+    float Value(char letter);
+    long IValue(char letter);
+    char* String(); // The string argument, if any; "" if none
+    long LineNumber(); // -1 if there was no N word
+    boolean Empty(); // True for blank lines and comments
+
+  private:
+
+    float ReadNumber(char*& p);
+    int Slot(char letter);
+    boolean TakesString(long mCode);
+
+    unsigned long seen; // Bit i is set if letter 'A' + i was in the line
+    float values[GCODE_LETTER_COUNT];
+    char* string;
+};
+
+// What's known about a G Code file without reading it: where lines and layers start, the filament
+// it uses and roughly how long it takes (from the feedrates alone).  It is worked out as the file
+// is uploaded, with no extra pass over it, and kept as an image of SidecarData in the sidecar
+// directory under the same name as the file.  Line k*lineStride starts at lineOffsets[k], and
+// layers the same.  When a table fills up every other entry is dropped and its stride doubled,
+// so files of any size fit; finding the line or layer at a byte offset is a binary search.
+// A layer starts with the line that set its height, and counts once something is extruded at it.
+
+struct SidecarData
+{
+  unsigned long magic;
+  unsigned long fileLength;
+  long lines;
+  long lineStride;
+  int lineEntries;
+  long layers;
+  long layerStride;
+  int layerEntries;
+  float filament; // mm
+  float duration; // seconds
+  unsigned long lineOffsets[SIDECAR_LINES];
+  unsigned long layerOffsets[SIDECAR_LAYERS];
+};
+
+class GCodeSidecar
+{
+  public:
+
+    GCodeSidecar();
+    void Init(Platform* p);
+    void Start(); // A new file is being uploaded...
+    void Scan(char* b, int length); // ...these are its next bytes...
+    boolean Save(char* fileName); // ...and it's finished
+    boolean Load(char* fileName, unsigned long fileLength); // False if there isn't an up-to-date one
+    void Remove(char* fileName);
+    boolean Loaded();
+    long LineAt(unsigned long offset); // The nearest line at or before offset
+    long LayerAt(unsigned long offset); // The layer offset is in
+    unsigned long LayerOffset(long& layer); // Where a layer starts; layer becomes the one actually found
+    long Lines();
+    long Layers();
+    float Filament();
+    float Duration();
+
+  private:
+
+    char* SidecarName(char* fileName);
+    void EndLine();
+    void ScanMove();
+    void Add(unsigned long table[], int& entries, long& stride, int size, long n, unsigned long offset);
+    long Find(unsigned long table[], int entries, long stride, unsigned long offset);
+
+    Platform* platform;
+    SidecarData data;
+    boolean loaded;
+    char sidecarName[GCODE_LENGTH];
+    char line[GCODE_LENGTH];
+    int linePointer;
+    unsigned long scanned; // Bytes so far
+    unsigned long lineStart;
+    GCodeRecord record;
+    float position[DRIVES];
+    float feedRate; // mm/sec
+    float distanceScale;
+    boolean axesRelative;
+    boolean extrudersRelative;
+    float layerZ;
+    unsigned long heightStart; // Where the line that last changed the height starts
+};
+
+// A ring of complete lines of G Code waiting to be interpreted.  Any number of sources (the
+// web interface, the serial line, a file being printed) can put lines in; GCodes takes them
+// out in the order they arrived.  Its depth and high-water mark, and the number of times the
+// planner could have taken a move but found the queue empty, show whether the sources are
+// keeping up.
+
+class CommandQueue
+{
+  public:
+
+    CommandQueue(Platform* p);
+    void Init();
+    boolean Put(char* line, byte source, unsigned long offset); // Copies the line; false if there is no room for that source or it is too long
+    char* Get(); // The oldest line, left in the queue; 0 if there isn't one
+    byte GetSource(); // Where that line came from...
+    unsigned long GetOffset(); // ...and where it starts in the file if that was FILE_SOURCE
+    unsigned long FileOffset(); // Where the oldest line from the file starts; NO_FILE_OFFSET if there isn't one
+    void Done(); // Finished with the oldest line
+    int Depth();
+    int Space(byte source); // Lines that source may still put on the queue
+    int HighWater();
+    void Hungry(); // Note that the planner is waiting for the queue; counted once until the next line is done
+    unsigned long HungryCount();
+
+  private:
+
+    int Next(int i);
+
+    Platform* platform;
+    char lines[COMMAND_QUEUE_LENGTH][GCODE_LENGTH];
+    byte sources[COMMAND_QUEUE_LENGTH];
+    unsigned long offsets[COMMAND_QUEUE_LENGTH];
+    int addPointer;
+    int readPointer;
+    int depth;
+    int highWater;
+    unsigned long hungryCount;
+    boolean hungry;
+};
+
+// Printing a G Code file from the SD card.  The file is read a block at a time into one of two
+// buffers while the lines in the other are split off and put on the command queue, so there is
+// always a block of G Code in RAM behind the one being used and the queue doesn't have to wait
+// for the card.  The byte offset of the next line to be queued is always known, so a print can be
+// paused and resumed, or restarted from any offset, without reading the file from the start.
+
+class PrintJob
+{
+  public:
+
+    PrintJob();
+    void Init(Platform* p, CommandQueue* q);
+    boolean Select(char* fileName); // Open a file to print (M23); relative names are in the G Code directory
+    void Start(); // Start or resume (M24)
+    void Pause(); // Stop queueing lines (M25)
+    boolean SetOffset(unsigned long offset); // Carry on from this byte in the file (M26)
+    boolean SetLayer(long& layer); // Or from the start of a layer, if the file has a sidecar index
+    void Spin();
+    boolean Selected();
+    boolean Printing();
+    unsigned long Offset(); // Where the next line to be queued starts - see GCodes::PrintedOffset() for where the machine has got to
+    unsigned long Length();
+    GCodeSidecar* Sidecar();
+    
+  private:
+
+    void FillBlock(int b);
+    void Finish();
+
+    Platform* platform;
+    CommandQueue* queue;
+    int file;
+    byte blocks[2][SD_BLOCK_LENGTH];
+    int blockLength[2];
+    unsigned long blockStart[2]; // Where each block came from in the file
+    int current; // The block lines are being taken from; the other is being read ahead
+    int blockPointer;
+    unsigned long readOffset; // The next byte to read from the file
+    boolean endOfFile;
+    char line[GCODE_LENGTH];
+    int linePointer;
+    unsigned long lineStart; // Where the line being assembled (or waiting to be queued) starts
+    unsigned long nextLineStart;
+    boolean lineReady;
+    boolean printing;
+    GCodeSidecar sidecar;
+};
+
 class GCodes
-{   
+{
   public:
-  
-    GCodes(Platform* p, Move* m, Heat* h, Webserver* w);
+
+    GCodes(Platform* p, Move* m, Heat* h, Webserver* w, CommandQueue* q);
     void Spin();
+    boolean HasWork(); // Is there anything for Spin() to do?
     void Init();
     void Exit();
-    
+    PrintJob* GetPrintJob();
+    unsigned long PrintedOffset(); // Where in the file the oldest line not yet done (moves and all) starts - where to restart a print
+
   private:
-  
-    void ActOnGcode();
-  
+
+    boolean ActOnGcode(); // False if it can't be done yet; it will be called again
+    void LoadMoveBuffer(); // Take the drive positions and the feedrate from the record
+    boolean SetUpMove();
+    boolean ArcMove();
+    boolean SetUpArc();
+    boolean SetPositions();
+    boolean Home();
+    boolean ProbeBed();
+    void ReadSerial();
+    void ReportPrintProgress();
+    void SetLayer();
+    boolean Simulate();
+    void EndSimulation();
+    void ReportSimulation();
+    void ReportTemperatures();
+    boolean SetPidConstants();
+    boolean AutoTune();
+    boolean SetDriveSettings();
+    void ResetStepPositions();
+    int Heater();
+
     Platform* platform;
     boolean active;
     Move* move;
     Heat* heat;
     Webserver* webserver;
+    CommandQueue* queue;
     unsigned long lastTime;
-    char gcodeBuffer[GCODE_LENGTH];
-    int gcodePointer;
+    char serialBuffer[GCODE_LENGTH];
+    int serialPointer;
+    boolean serialLineReady;
+    char* gcodeLine;
+    char progressString[GCODE_LENGTH];
+    GCodeRecord record;
+    PrintJob printJob;
+    boolean gcodeWaiting;
+    float moveBuffer[DRIVES];
+    float arcStart[DRIVES]; // The arc being cut into chords...
+    float arcCentre[2]; // ...in the X-Y plane
+    float arcStartX, arcStartY; // From the centre to the start...
+    float arcX, arcY; // ...and to the end of the last chord queued
+    float arcAngle; // Radians per chord, anticlockwise positive
+    float arcCos, arcSin;
+    int arcChords; // 0 if there's no arc in progress
+    int arcChord; // Chords queued so far
+    float feedRate; // mm/sec
+    boolean axesRelative;
+    boolean extrudersRelative;
+    float distanceScale;
+    unsigned long simulationStart;
+    float savedFeedRate; // The modes the simulated file may change, put back when simulation ends
+    boolean savedAxesRelative;
+    boolean savedExtrudersRelative;
+    float savedDistanceScale;
+    boolean simulationPrinting; // A file has been printing since simulation started
+    byte homingAxes; // Bit i is set until axis i has been homed
+    int homingPhase; // 0 when not homing
+    int probePhase; // 0 when not probing the bed
+    int probePoint; // The point being probed, counting along X first
+    float bedHeights[BED_GRID*BED_GRID]; // Z where the probe triggered at each point
+    unsigned long lineOffset; // Where the line being done starts in the file being printed; NO_FILE_OFFSET if it isn't from the file
 };
 
+//*****************************************************************************************************
+
+inline PrintJob* GCodes::GetPrintJob()
+{
+  return &printJob;
+}
+
+// Lines to interpret or to read
+
+inline boolean GCodes::HasWork()
+{
+  return queue->Depth() || gcodeWaiting || serialLineReady || platform->SerialAvailable() ||
+    printJob.Printing() || move->Simulating();
+}
+
+//*****************************************************************************************************
+
+inline int CommandQueue::Next(int i)
+{
+  i++;
+  if(i >= COMMAND_QUEUE_LENGTH)
+    i = 0;
+  return i;
+}
+
+inline int CommandQueue::Depth()
+{
+  return depth;
+}
+
+inline int CommandQueue::Space(byte source)
+{
+  int space = COMMAND_QUEUE_LENGTH - depth;
+  if(source == FILE_SOURCE)
+    space -= INTERACTIVE_LINES;
+  return space > 0 ? space : 0;
+}
+
+inline int CommandQueue::HighWater()
+{
+  return highWater;
+}
+
+inline void CommandQueue::Hungry()
+{
+  if(hungry)
+    return;
+  hungry = true;
+  hungryCount++;
+}
+
+inline unsigned long CommandQueue::HungryCount()
+{
+  return hungryCount;
+}
+
+inline char* CommandQueue::Get()
+{
+  if(!depth)
+    return 0;
+  return lines[readPointer];
+}
+
+inline byte CommandQueue::GetSource()
+{
+  return sources[readPointer];
+}
+
+inline unsigned long CommandQueue::GetOffset()
+{
+  return offsets[readPointer];
+}
+
+//*****************************************************************************************************
+
+inline boolean GCodeSidecar::Loaded()
+{
+  return loaded;
+}
+
+inline long GCodeSidecar::Lines()
+{
+  return data.lines;
+}
+
+inline long GCodeSidecar::Layers()
+{
+  return data.layers;
+}
+
+inline float GCodeSidecar::Filament()
+{
+  return data.filament;
+}
+
+inline float GCodeSidecar::Duration()
+{
+  return data.duration;
+}
+
+inline long GCodeSidecar::LineAt(unsigned long offset)
+{
+  return Find(data.lineOffsets, data.lineEntries, data.lineStride, offset);
+}
+
+inline long GCodeSidecar::LayerAt(unsigned long offset)
+{
+  return Find(data.layerOffsets, data.layerEntries, data.layerStride, offset);
+}
+
+//*****************************************************************************************************
+
+inline boolean PrintJob::Selected()
+{
+  return file >= 0;
+}
+
+inline boolean PrintJob::Printing()
+{
+  return printing;
+}
+
+inline unsigned long PrintJob::Offset()
+{
+  return lineStart;
+}
+
+inline GCodeSidecar* PrintJob::Sidecar()
+{
+  return &sidecar;
+}
+
+//*****************************************************************************************************
+
+inline int GCodeRecord::Slot(char letter)
+{
+  return toupper(letter) - 'A';
+}
+
+inline boolean GCodeRecord::Seen(char letter)
+{
+  return (seen & (1ul << Slot(letter))) != 0;
+}
+
+inline float GCodeRecord::Value(char letter)
+{
+  return values[Slot(letter)];
+}
+
+inline long GCodeRecord::IValue(char letter)
+{
+  return (long)values[Slot(letter)];
+}
+
+inline char* GCodeRecord::String()
+{
+  return string;
+}
+
+inline long GCodeRecord::LineNumber()
+{
+  if(Seen('N'))
+    return IValue('N');
+  return -1;
+}
+
+inline boolean GCodeRecord::Empty()
+{
+  return !seen;
+}
+
 #endif
@@ -21,14 +21,17 @@ Licence: GPL
 
 #include "RepRapFirmware.h"
 
-GCodes::GCodes(Platform* p, Move* m, Heat* h, Webserver* w)
+const char gCodeLetters[DRIVES] = GCODE_LETTERS;
+
+GCodes::GCodes(Platform* p, Move* m, Heat* h, Webserver* w, CommandQueue* q)
 {
   active = false;
-  //Serial.println("GCodes constructor"); 
+  //Serial.println("GCodes constructor");
   platform = p;
   move = m;
   heat = h;
   webserver = w;
+  queue = q;
 }
 
 void GCodes::Exit()
@@ -39,44 +42,1431 @@ void GCodes::Exit()
 void GCodes::Init()
 {
   lastTime = platform->Time();
-  gcodePointer = 0;
+  serialPointer = 0;
+  serialLineReady = false;
+  gcodeLine = "";
+  gcodeWaiting = false;
+  for(int i = 0; i < DRIVES; i++)
+    moveBuffer[i] = 0.0;
+  feedRate = platform->MaxFeedrate(X_AXIS);
+  axesRelative = false;
+  extrudersRelative = platform->DriveRelativeMode(AXES);
+  distanceScale = 1.0;
+  arcChords = 0;
+  homingPhase = 0;
+  probePhase = 0;
+  lineOffset = NO_FILE_OFFSET;
+  printJob.Init(platform, queue);
   active = true;
 }
 
+// Absolute or relative positions for each drive, scaled to mm, and a feedrate in mm/min
 
+void GCodes::LoadMoveBuffer()
+{
+  boolean relative;
+  for(int i = 0; i < DRIVES; i++)
+  {
+    if(!record.Seen(gCodeLetters[i]))
+      continue;
+    if(i < AXES)
+      relative = axesRelative;
+    else
+      relative = extrudersRelative;
+    if(relative)
+      moveBuffer[i] += record.Value(gCodeLetters[i])*distanceScale;
+    else
+      moveBuffer[i] = record.Value(gCodeLetters[i])*distanceScale;
+  }
+  if(record.Seen('F') && record.Value('F') > 0.0) // F0 would stop the machine; keep the last feedrate
+    feedRate = record.Value('F')*distanceScale/60.0;
+}
 
-void GCodes::ActOnGcode()
+boolean GCodes::SetUpMove()
 {
-  platform->Message(HOST_MESSAGE, "GCode: ");
-  platform->Message(HOST_MESSAGE, gcodeBuffer);
+  if(move->QueueFull())
+    return false;
+  LoadMoveBuffer();
+  return move->AddMove(moveBuffer, feedRate);
+}
+
+// G2 (clockwise) and G3 (anticlockwise) arcs in the X-Y plane are cut into chords no further
+// than ARC_TOLERANCE from the arc, and as many are queued as Move will take each time this is
+// called.  Each chord's end is found by rotating the last one's through a fixed angle, which
+// costs four multiplies instead of a sine and a cosine; every ARC_CORRECTION chords it is worked
+// out exactly so rounding errors can't build up.  The other drives move linearly, so Z gives a helix.
+
+boolean GCodes::ArcMove()
+{
+  int i;
+  if(!arcChords && !SetUpArc())
+  {
+    for(i = 0; i < DRIVES; i++)
+      moveBuffer[i] = arcStart[i];
+    return true;
+  }
+
+  float point[DRIVES];
+  float x, y, a, fraction;
+  int next;
+  while(arcChord < arcChords)
+  {
+    next = arcChord + 1;
+    if(next % ARC_CORRECTION)
+    {
+      x = arcX*arcCos - arcY*arcSin;
+      y = arcX*arcSin + arcY*arcCos;
+    } else
+    {
+      a = next*arcAngle;
+      x = arcStartX*cos(a) - arcStartY*sin(a);
+      y = arcStartX*sin(a) + arcStartY*cos(a);
+    }
+    if(next >= arcChords)
+    {
+      for(i = 0; i < DRIVES; i++)
+        point[i] = moveBuffer[i];
+    } else
+    {
+      fraction = (float)next/(float)arcChords;
+      for(i = 0; i < DRIVES; i++)
+        point[i] = arcStart[i] + (moveBuffer[i] - arcStart[i])*fraction;
+      point[X_AXIS] = arcCentre[0] + x;
+      point[Y_AXIS] = arcCentre[1] + y;
+    }
+    if(!move->AddMove(point, feedRate))
+      return false;
+    arcX = x;
+    arcY = y;
+    arcChord = next;
+  }
+  arcChords = 0;
+  return true;
+}
+
+// The centre is given either by I and J (relative to the start) or by the radius R, which is
+// negative for the longer of the two arcs that R allows.  An end that's the same as the start
+// with I and J means a full circle.  Returns false if the arc is impossible, leaving arcStart
+// as where the machine was.
+
+boolean GCodes::SetUpArc()
+{
+  int i;
+  for(i = 0; i < DRIVES; i++)
+    arcStart[i] = moveBuffer[i];
+  LoadMoveBuffer();
+  boolean clockwise = record.IValue('G') == 2;
+  float dx = moveBuffer[X_AXIS] - arcStart[X_AXIS];
+  float dy = moveBuffer[Y_AXIS] - arcStart[Y_AXIS];
+  float radius;
+  if(record.Seen('R'))
+  {
+    radius = record.Value('R')*distanceScale;
+    float d2 = dx*dx + dy*dy;
+    float h2 = 4.0*radius*radius - d2;
+    if(d2 <= 0.0 || h2 < 0.0)
+    {
+      platform->Message(HOST_MESSAGE, "GCodes: arc radius too small.<br>\n", LOG_ERROR);
+      return false;
+    }
+    float h = -sqrt(h2/d2);
+    if(!clockwise)
+      h = -h;
+    if(radius < 0.0)
+    {
+      h = -h;
+      radius = -radius;
+    }
+    arcStartX = -0.5*(dx - dy*h);
+    arcStartY = -0.5*(dy + dx*h);
+  } else
+  {
+    arcStartX = -record.Value('I')*distanceScale;
+    arcStartY = -record.Value('J')*distanceScale;
+    radius = sqrt(arcStartX*arcStartX + arcStartY*arcStartY);
+    if(radius <= 0.0)
+    {
+      platform->Message(HOST_MESSAGE, "GCodes: arc with no radius.<br>\n", LOG_ERROR);
+      return false;
+    }
+  }
+  arcCentre[0] = arcStart[X_AXIS] - arcStartX;
+  arcCentre[1] = arcStart[Y_AXIS] - arcStartY;
+
+  float endX = moveBuffer[X_AXIS] - arcCentre[0];
+  float endY = moveBuffer[Y_AXIS] - arcCentre[1];
+  float angle = atan2(arcStartX*endY - arcStartY*endX, arcStartX*endX + arcStartY*endY);
+  if(clockwise && angle >= 0.0)
+    angle -= 2.0*PI;
+  else if(!clockwise && angle <= 0.0)
+    angle += 2.0*PI;
+
+  // The furthest a chord through angle t is from its arc is radius*(1 - cos(t/2))
+
+  float c = 1.0 - ARC_TOLERANCE/radius;
+  if(c < 0.0)
+    c = 0.0;
+  arcChords = (int)ceil(fabs(angle)/(2.0*acos(c)));
+  if(arcChords < 1)
+    arcChords = 1;
+  arcAngle = angle/arcChords;
+  arcCos = cos(arcAngle);
+  arcSin = sin(arcAngle);
+  arcX = arcStartX;
+  arcY = arcStartY;
+  arcChord = 0;
+  return true;
+}
+
+// G28 - home the axes given, or all of them, one at a time.  Each is moved quickly towards its
+// endstop until it hits it, backed off, and moved slowly back on to it, which gives the position.
+// Each phase waits for the last to finish.
+
+boolean GCodes::Home()
+{
+  int axis;
+  if(!homingPhase)
+  {
+    homingAxes = 0;
+    for(axis = 0; axis < AXES; axis++)
+    {
+      if(record.Seen(gCodeLetters[axis]))
+        homingAxes |= 1 << axis;
+    }
+    if(!homingAxes)
+      homingAxes = (1 << AXES) - 1;
+    homingPhase = 1;
+  }
+
+  while(homingAxes)
+  {
+    if(!move->Idle())
+      return false;
+    for(axis = 0; !(homingAxes & (1 << axis)); axis++)
+      ;
+    int direction = platform->HomingDirection(axis);
+    if(direction < 0)
+    {
+      platform->Message(HOST_MESSAGE, "GCodes: no endstop to home to.<br>\n", LOG_ERROR);
+      homingAxes &= ~(1 << axis);
+      continue;
+    }
+    float end = direction == FORWARDS ? platform->AxisLength(axis) : 0.0;
+    float towards = direction == FORWARDS ? 1.0 : -1.0;
+    float feedRate = platform->HomeFeedrate(axis);
+    if(move->Simulating())
+      homingPhase = 4;
+    else if((homingPhase == 2 || homingPhase == 4) && !move->EndstopHit())
+    {
+      platform->Message(HOST_MESSAGE, "GCodes: endstop not found when homing.<br>\n", LOG_ERROR);
+      homingPhase = 0;
+      return true;
+    }
+
+    switch(homingPhase)
+    {
+    case 1: // Far enough to get to the endstop from anywhere
+      move->GetLastPosition(moveBuffer);
+      moveBuffer[axis] += 1.5*towards*platform->AxisLength(axis);
+      if(!move->AddHomingMove(moveBuffer, feedRate, axis, direction))
+        return false;
+      homingPhase = 2;
+      break;
+
+    case 2:
+      moveBuffer[axis] = end;
+      move->SetLastPosition(moveBuffer);
+      moveBuffer[axis] = end - towards*HOME_BACK_OFF;
+      if(!move->AddMove(moveBuffer, feedRate))
+        return false;
+      homingPhase = 3;
+      break;
+
+    case 3:
+      moveBuffer[axis] = end + towards*HOME_BACK_OFF;
+      if(!move->AddHomingMove(moveBuffer, feedRate*SLOW_HOME_FRACTION, axis, direction))
+        return false;
+      homingPhase = 4;
+      break;
+
+    default:
+      move->GetLastPosition(moveBuffer);
+      moveBuffer[axis] = end;
+      move->SetLastPosition(moveBuffer);
+      homingAxes &= ~(1 << axis);
+      homingPhase = 1;
+    }
+  }
+  homingPhase = 0;
+  return true;
+}
+
+// G29 - lower the Z probe onto the bed at each point of the BED_GRID x BED_GRID grid (see
+// BedMesh in Move.h), and from then on compensate for the shape it finds.  The heights are
+// relative to Z = 0, so Z should be homed first.  G29 S0 stops compensating.
+
+boolean GCodes::ProbeBed()
+{
+  if(!probePhase)
+  {
+    if(!move->Idle())
+      return false;
+    if(move->Simulating()) // The mesh belongs to the real machine
+      return true;
+    if(record.Seen('S') && !record.IValue('S'))
+    {
+      move->ClearBedMesh();
+      return true;
+    }
+    if(platform->HomingDirection(Z_AXIS) != BACKWARDS)
+    {
+      platform->Message(HOST_MESSAGE, "GCodes: there is no Z probe.<br>\n", LOG_ERROR);
+      return true;
+    }
+    move->ClearBedMesh();
+    probePoint = 0;
+    probePhase = 1;
+  }
+
+  for(;;)
+  {
+    switch(probePhase)
+    {
+    case 1: // Up...
+      move->GetLastPosition(moveBuffer);
+      moveBuffer[Z_AXIS] = BED_PROBE_HEIGHT;
+      if(!move->AddMove(moveBuffer, platform->MaxFeedrate(Z_AXIS)))
+        return false;
+      probePhase = probePoint < BED_GRID*BED_GRID ? 2 : 5;
+      break;
+
+    case 2: // ...across...
+      move->GetBedMesh()->ProbePoint(probePoint, moveBuffer[X_AXIS], moveBuffer[Y_AXIS]);
+      if(!move->AddMove(moveBuffer, platform->MaxFeedrate(X_AXIS)))
+        return false;
+      probePhase = 3;
+      break;
+
+    case 3: // ...and down until the probe touches
+      if(!move->Idle())
+        return false;
+      if(platform->ZProbe())
+      {
+        platform->Message(HOST_MESSAGE, "GCodes: the Z probe is triggered above the bed.<br>\n", LOG_ERROR);
+        probePhase = 0;
+        return true;
+      }
+      moveBuffer[Z_AXIS] = -BED_PROBE_HEIGHT;
+      if(!move->AddHomingMove(moveBuffer, platform->HomeFeedrate(Z_AXIS), Z_AXIS, BACKWARDS))
+        return false;
+      probePhase = 4;
+      break;
+
+    case 4:
+      if(!move->Idle())
+        return false;
+      if(!move->EndstopHit())
+      {
+        platform->Message(HOST_MESSAGE, "GCodes: the Z probe didn't find the bed.<br>\n", LOG_ERROR);
+        probePhase = 0;
+        return true;
+      }
+      move->GetLastPosition(moveBuffer);
+      bedHeights[probePoint] = moveBuffer[Z_AXIS];
+      probePoint++;
+      probePhase = 1;
+      break;
+
+    default: // Up from the last point, and start compensating
+      if(!move->Idle())
+        return false;
+      move->SetBedMesh(bedHeights);
+      move->GetLastPosition(moveBuffer);
+      probePhase = 0;
+      long lowest = (long)floor(1000.0*bedHeights[0] + 0.5);
+      long highest = lowest;
+      long h;
+      for(int i = 1; i < BED_GRID*BED_GRID; i++)
+      {
+        h = (long)floor(1000.0*bedHeights[i] + 0.5);
+        if(h < lowest)
+          lowest = h;
+        if(h > highest)
+          highest = h;
+      }
+      snprintf(progressString, GCODE_LENGTH, "Bed probed: heights from %ld to %ld microns.<br>\n", lowest, highest);
+      platform->Message(HOST_MESSAGE, progressString);
+      return true;
+    }
+  }
+}
+
+// G92 - the machine must have stopped, as the positions of moves already queued would be wrong
+
+boolean GCodes::SetPositions()
+{
+  if(!move->Idle())
+    return false;
+
+  for(int i = 0; i < DRIVES; i++)
+  {
+    if(record.Seen(gCodeLetters[i]))
+      moveBuffer[i] = record.Value(gCodeLetters[i])*distanceScale;
+  }
+  move->SetLastPosition(moveBuffer);
+  return true;
+}
+
+boolean GCodes::ActOnGcode()
+{
+  if(record.Seen('G'))
+  {
+    switch(record.IValue('G'))
+    {
+    case 0:
+    case 1:
+      return SetUpMove();
+
+    case 2:
+    case 3:
+      return ArcMove();
+
+    case 20:
+      distanceScale = INCH;
+      return true;
+
+    case 21:
+      distanceScale = 1.0;
+      return true;
+
+    case 90:
+      axesRelative = false;
+      return true;
+
+    case 91:
+      axesRelative = true;
+      return true;
+
+    case 28:
+      return Home();
+
+    case 29:
+      return ProbeBed();
+
+    case 92:
+      return SetPositions();
+
+    default:
+      break;
+    }
+  } else if(record.Seen('M'))
+  {
+    switch(record.IValue('M'))
+    {
+    case 82:
+      extrudersRelative = false;
+      return true;
+
+    case 83:
+      extrudersRelative = true;
+      return true;
+
+    case 23:
+      printJob.Select(record.String());
+      return true;
+
+    case 24:
+      printJob.Start();
+      return true;
+
+    case 25:
+      printJob.Pause();
+      return true;
+
+    case 26:
+      if(record.Seen('S'))
+        printJob.SetOffset(record.IValue('S'));
+      else if(record.Seen('L'))
+        SetLayer();
+      return true;
+
+    case 27:
+      ReportPrintProgress();
+      return true;
+
+    case 92: // Set steps per mm
+    case 201: // Set accelerations
+    case 203: // Set feedrates
+      if(move->Simulating())
+        return true;
+      return SetDriveSettings();
+
+    case 37: // Simulate printing
+      return Simulate();
+
+    case 104: // Set the extruder temperature...
+    case 109: // ...and wait for it
+      if(move->Simulating())
+        return true;
+      if(record.Seen('S'))
+        heat->SetTemperature(E0_HEATER, record.Value('S'));
+      return record.IValue('M') == 104 || heat->AtTemperature(E0_HEATER);
+
+    case 105:
+      ReportTemperatures();
+      return true;
+
+    case 122:
+      reprap.Diagnostics();
+      return true;
+
+    case 140: // Set the bed temperature...
+    case 190: // ...and wait for it
+      if(move->Simulating())
+        return true;
+      if(record.Seen('S'))
+        heat->SetTemperature(BED_HEATER, record.Value('S'));
+      return record.IValue('M') == 140 || heat->AtTemperature(BED_HEATER);
+
+    case 301: // Set PID constants
+      if(move->Simulating())
+        return true;
+      return SetPidConstants();
+
+    case 303: // Autotune a heater
+      return AutoTune();
+
+    case 500: // Save the settings for the next restart
+      if(move->Simulating())
+        return true;
+      if(platform->SaveToStore())
+        platform->Message(HOST_MESSAGE, "Settings saved.<br>\n");
+      return true;
+
+    case 501: // Go back to the saved settings
+      if(move->Simulating())
+        return true;
+      if(!move->Idle())
+        return false;
+      platform->ReloadFromStore();
+      ResetStepPositions();
+      return true;
+
+    default:
+      break;
+    }
+  } else if(record.Seen('T'))
+    return true;
+
+  platform->Message(HOST_MESSAGE, "GCodes: unsupported G Code: ");
+  platform->Message(HOST_MESSAGE, gcodeLine);
   platform->Message(HOST_MESSAGE, "<br>\n");
+  return true;
 }
 
+// The heater an M code's H word refers to; the first extruder if there isn't one.  -1 if there's
+// no such heater.
 
+int GCodes::Heater()
+{
+  if(!record.Seen('H'))
+    return E0_HEATER;
+  int heater = record.IValue('H');
+  if(heater >= 0 && heater < HEATERS)
+    return heater;
+  platform->Message(HOST_MESSAGE, "GCodes: no such heater.<br>\n", LOG_ERROR);
+  return -1;
+}
+
+// M301 H<heater> P<kp> I<ki> D<kd>.  Constants that aren't given are left as they are.
+
+boolean GCodes::SetPidConstants()
+{
+  int heater = Heater();
+  if(heater < 0)
+    return true;
+  float kp = record.Seen('P') ? record.Value('P') : platform->PidKp(heater);
+  float ki = record.Seen('I') ? record.Value('I') : platform->PidKi(heater);
+  float kd = record.Seen('D') ? record.Value('D') : platform->PidKd(heater);
+  platform->SetPid(heater, kp, ki, kd);
+  return true;
+}
+
+// M303 H<heater> S<temperature> C<cycles>.  There is no default temperature to tune at.
+
+boolean GCodes::AutoTune()
+{
+  if(move->Simulating())
+    return true;
+  if(!record.Seen('S'))
+  {
+    platform->Message(HOST_MESSAGE, "GCodes: M303 needs a temperature (S).<br>\n", LOG_ERROR);
+    return true;
+  }
+  int heater = Heater();
+  if(heater >= 0)
+    heat->AutoTune(heater, record.Value('S'), record.Seen('C') ? record.IValue('C') : AUTOTUNE_CYCLES);
+  return true;
+}
+
+// M92, M201 and M203 set the steps per mm, accelerations (mm/sec^2) and feedrates (mm/sec)
+// of the drives given.  Changing the steps per mm waits for the moves already planned to finish.
+
+boolean GCodes::SetDriveSettings()
+{
+  long mCode = record.IValue('M');
+  if(mCode == 92 && !move->Idle())
+    return false;
+  for(int i = 0; i < DRIVES; i++)
+  {
+    if(!record.Seen(gCodeLetters[i]))
+      continue;
+    float value = record.Value(gCodeLetters[i]);
+    if(value <= 0.0)
+      continue;
+    if(mCode == 92)
+      platform->SetDriveStepsPerUnit(i, value);
+    else if(mCode == 201)
+      platform->SetAcceleration(i, value);
+    else
+      platform->SetMaxFeedrate(i, value);
+  }
+  if(mCode == 92)
+    ResetStepPositions();
+  return true;
+}
+
+// Work out where the drives are in steps again after the steps per mm may have changed
+
+void GCodes::ResetStepPositions()
+{
+  float position[DRIVES];
+  move->GetLastPosition(position);
+  move->SetLastPosition(position);
+}
+
+// Assemble lines from the serial line and put them on the queue.  If the queue is full
+// the line is held, and nothing more is read until it has gone in.
+
+void GCodes::ReadSerial()
+{
+  if(serialLineReady)
+  {
+    if(!queue->Put(serialBuffer, SERIAL_SOURCE, NO_FILE_OFFSET))
+      return;
+    serialLineReady = false;
+  }
+
+  while(platform->SerialAvailable())
+  {
+    char c = platform->SerialRead();
+    if(c == '\n' || c == '\r' || !c)
+    {
+      serialBuffer[serialPointer] = 0;
+      if(!serialPointer)
+        continue;
+      serialPointer = 0;
+      if(!queue->Put(serialBuffer, SERIAL_SOURCE, NO_FILE_OFFSET))
+      {
+        serialLineReady = true;
+        return;
+      }
+    } else
+    {
+      serialBuffer[serialPointer++] = c;
+      if(serialPointer >= GCODE_LENGTH)
+      {
+        platform->Message(HOST_MESSAGE, "GCodes: serial G Code buffer length overflow.<br>\n");
+        serialPointer = 0;
+      }
+    }
+  }
+}
+
+void GCodes::ReportPrintProgress()
+{
+  if(!printJob.Selected())
+  {
+    platform->Message(HOST_MESSAGE, "Not printing from a file.<br>\n");
+    return;
+  }
+  GCodeSidecar* sidecar = printJob.Sidecar();
+  unsigned long offset = PrintedOffset();
+  if(sidecar->Loaded())
+    snprintf(progressString, GCODE_LENGTH, "Print byte %lu/%lu, line %ld/%ld, layer %ld/%ld%s<br>\n", offset,
+      printJob.Length(), sidecar->LineAt(offset) + 1, sidecar->Lines(), sidecar->LayerAt(offset) + 1,
+      sidecar->Layers(), printJob.Printing() ? "" : " (paused)");
+  else
+    snprintf(progressString, GCODE_LENGTH, "Print byte %lu/%lu%s<br>\n", offset, printJob.Length(),
+      printJob.Printing() ? "" : " (paused)");
+  platform->Message(HOST_MESSAGE, progressString);
+}
+
+// M37 S1 starts simulating: moves are planned but not made, and heaters and settings are left
+// alone.  It ends with M37 S0, or when a file printed while simulating finishes.  M37 on its own
+// reports how it's going.
+
+boolean GCodes::Simulate()
+{
+  if(!record.Seen('S'))
+  {
+    ReportSimulation();
+    return true;
+  }
+  if(!move->Idle())
+    return false;
+  boolean on = record.IValue('S') > 0;
+  if(on == move->Simulating())
+    return true;
+  if(on)
+  {
+    move->ResetStatistics();
+    move->Simulate(true);
+    savedFeedRate = feedRate;
+    savedAxesRelative = axesRelative;
+    savedExtrudersRelative = extrudersRelative;
+    savedDistanceScale = distanceScale;
+    simulationStart = platform->Time();
+    simulationPrinting = false;
+    platform->Message(HOST_MESSAGE, "Simulating.<br>\n");
+    return true;
+  }
+  EndSimulation();
+  return true;
+}
+
+// Put the machine back as it was when simulation started, and say how it went.
+
+void GCodes::EndSimulation()
+{
+  move->Simulate(false);
+  move->GetLastPosition(moveBuffer);
+  feedRate = savedFeedRate;
+  axesRelative = savedAxesRelative;
+  extrudersRelative = savedExtrudersRelative;
+  distanceScale = savedDistanceScale;
+  ReportSimulation();
+}
+
+// One line of name=value pairs, so it can be picked up by a program.  wall_ms is the real time
+// since simulation started.  The line is sent in two parts, each of which fits progressString
+// whatever the numbers.
+
+void GCodes::ReportSimulation()
+{
+  unsigned long wall = platform->Time() - simulationStart;
+  unsigned long moves = move->MovesDone();
+  snprintf(progressString, GCODE_LENGTH, "Simulation: moves=%lu print_ms=%lu wall_ms=%lu",
+    moves, (unsigned long)(1000.0*move->MoveTime()), wall/1000);
+  platform->Message(HOST_MESSAGE, progressString);
+  snprintf(progressString, GCODE_LENGTH, " moves_per_wall_s=%lu queue_peak=%d<br>\n",
+    (unsigned long)((float)moves*1000000.0/(float)(wall ? wall : 1)), move->QueuePeak());
+  platform->Message(HOST_MESSAGE, progressString);
+}
+
+// M26 L<layer> - carry on from the start of a layer (counting from 1)
+
+void GCodes::SetLayer()
+{
+  long layer = record.IValue('L') - 1;
+  if(!printJob.SetLayer(layer))
+    return;
+  snprintf(progressString, GCODE_LENGTH, "Printing from layer %ld.<br>\n", layer + 1);
+  platform->Message(HOST_MESSAGE, progressString);
+}
+
+// Temperatures to a tenth of a degree; the bed is B, extruders are T.
+
+void GCodes::ReportTemperatures()
+{
+  long e = (long)(10.0*heat->GetTemperature(E0_HEATER) + 0.5);
+  long b = (long)(10.0*heat->GetTemperature(BED_HEATER) + 0.5);
+  snprintf(progressString, GCODE_LENGTH, "T:%ld.%ld B:%ld.%ld<br>\n", e/10, e%10, b/10, b%10);
+  platform->Message(HOST_MESSAGE, progressString);
+}
+
+// Interpret up to GCODE_BATCH lines from the queue.  Each line is parsed where it lies in the
+// queue; once it has been parsed it is kept and offered to ActOnGcode() until that can deal
+// with it (for example when there is room in the move queue).
 
 void GCodes::Spin()
 {
   if(!active)
     return;
-    
-  if(webserver->Available())
+
+  ReadSerial();
+  printJob.Spin();
+
+  if(move->Simulating())
+  {
+    if(printJob.Printing())
+      simulationPrinting = true;
+    else if(simulationPrinting && !queue->Depth() && move->Idle())
+      EndSimulation();
+  }
+
+  for(int i = 0; i < GCODE_BATCH; i++)
+  {
+    if(!gcodeWaiting)
+    {
+      gcodeLine = queue->Get();
+      if(!gcodeLine)
+      {
+        lineOffset = NO_FILE_OFFSET;
+        if(!move->Idle() && !move->QueueFull())
+          queue->Hungry();
+        gcodeLine = "";
+        return;
+      }
+      lineOffset = queue->GetSource() == FILE_SOURCE ? queue->GetOffset() : NO_FILE_OFFSET;
+      move->SetFileOffset(lineOffset);
+      if(!record.Parse(gcodeLine))
+      {
+        platform->Message(HOST_MESSAGE, "GCodes: checksum error: ");
+        platform->Message(HOST_MESSAGE, gcodeLine);
+        platform->Message(HOST_MESSAGE, "<br>\n");
+        queue->Done();
+        continue;
+      }
+      if(record.Empty())
+      {
+        queue->Done();
+        continue;
+      }
+    }
+
+    if(!ActOnGcode())
+    {
+      gcodeWaiting = true;
+      return;
+    }
+    gcodeWaiting = false;
+    lineOffset = NO_FILE_OFFSET;
+    queue->Done();
+  }
+}
+
+// Lines and moves are done in the order they were read from the file, so the oldest not yet
+// done is the first of the move being made (or the oldest waiting to be), the line being done,
+// the oldest on the queue, and the next one to be read.
+
+unsigned long GCodes::PrintedOffset()
+{
+  unsigned long offset = move->FileOffset();
+  if(offset == NO_FILE_OFFSET)
+    offset = lineOffset;
+  if(offset == NO_FILE_OFFSET)
+    offset = queue->FileOffset();
+  if(offset == NO_FILE_OFFSET)
+    offset = printJob.Offset();
+  return offset;
+}
+
+//*****************************************************************************************************
+
+CommandQueue::CommandQueue(Platform* p)
+{
+  platform = p;
+}
+
+void CommandQueue::Init()
+{
+  addPointer = 0;
+  readPointer = 0;
+  depth = 0;
+  highWater = 0;
+  hungryCount = 0;
+  hungry = false;
+}
+
+boolean CommandQueue::Put(char* line, byte source, unsigned long offset)
+{
+  if(Space(source) <= 0)
+    return false;
+  if(strlen(line) > GCODE_LENGTH - 1)
+  {
+    platform->Message(HOST_MESSAGE, "CommandQueue: G Code too long.<br>\n");
+    return false;
+  }
+  strcpy(lines[addPointer], line);
+  sources[addPointer] = source;
+  offsets[addPointer] = offset;
+  addPointer = Next(addPointer);
+  depth++;
+  if(depth > highWater)
+    highWater = depth;
+  return true;
+}
+
+void CommandQueue::Done()
+{
+  if(!depth)
+    return;
+  readPointer = Next(readPointer);
+  depth--;
+  hungry = false;
+}
+
+unsigned long CommandQueue::FileOffset()
+{
+  int i = readPointer;
+  for(int n = 0; n < depth; n++)
+  {
+    if(sources[i] == FILE_SOURCE)
+      return offsets[i];
+    i = Next(i);
+  }
+  return NO_FILE_OFFSET;
+}
+
+//*****************************************************************************************************
+
+PrintJob::PrintJob()
+{
+  file = -1;
+  printing = false;
+}
+
+void PrintJob::Init(Platform* p, CommandQueue* q)
+{
+  platform = p;
+  queue = q;
+  sidecar.Init(p);
+  if(file >= 0)
+    platform->Close(file);
+  file = -1;
+  printing = false;
+}
+
+boolean PrintJob::Select(char* fileName)
+{
+  if(file >= 0)
+    platform->Close(file);
+  printing = false;
+  
+  char* dir = platform->GetGcodeDir();
+  if(strncmp(fileName, dir, strlen(dir)))
+    fileName = platform->PrependRoot(dir, fileName);
+  file = platform->OpenFile(fileName, false);
+  if(file < 0)
+    return false;
+  sidecar.Load(fileName, platform->Length(file));
+  return SetOffset(0);
+}
+
+void PrintJob::Start()
+{
+  if(file < 0)
   {
-    gcodeBuffer[gcodePointer] = webserver->Read();
-    if(gcodeBuffer[gcodePointer] == '\n' || !gcodeBuffer[gcodePointer])
+    platform->Message(HOST_MESSAGE, "No file selected to print.<br>\n");
+    return;
+  }
+  printing = true;
+}
+
+// Lines already on the command queue will still be done
+
+void PrintJob::Pause()
+{
+  printing = false;
+}
+
+boolean PrintJob::SetOffset(unsigned long offset)
+{
+  if(file < 0 || !platform->Seek(file, offset))
+    return false;
+  readOffset = offset;
+  lineStart = offset;
+  endOfFile = false;
+  blockLength[0] = 0;
+  blockLength[1] = 0;
+  current = 0;
+  blockPointer = 0;
+  linePointer = 0;
+  lineReady = false;
+  return true;
+}
+
+boolean PrintJob::SetLayer(long& layer)
+{
+  if(!sidecar.Loaded() || layer < 0 || layer >= sidecar.Layers())
+  {
+    platform->Message(HOST_MESSAGE, "No such layer in the sidecar index.<br>\n");
+    return false;
+  }
+  return SetOffset(sidecar.LayerOffset(layer));
+}
+
+unsigned long PrintJob::Length()
+{
+  if(file < 0)
+    return 0;
+  return platform->Length(file);
+}
+
+void PrintJob::FillBlock(int b)
+{
+  blockStart[b] = readOffset;
+  int i = platform->Read(file, (char*)blocks[b], SD_BLOCK_LENGTH);
+  blockLength[b] = i;
+  readOffset += i;
+  endOfFile = i < SD_BLOCK_LENGTH;
+}
+
+void PrintJob::Finish()
+{
+  platform->Close(file);
+  file = -1;
+  printing = false;
+  platform->Message(HOST_MESSAGE, "Print finished.<br>\n");
+}
+
+// Read one block ahead if there is room, then queue as many lines as the queue will take.
+// Blank lines and comments don't go on the queue.
+
+void PrintJob::Spin()
+{
+  if(!printing)
+    return;
+
+  int back = 1 - current;
+  if(!blockLength[back] && !endOfFile)
+    FillBlock(back);
+
+  char c;
+  while(queue->Space(FILE_SOURCE) > 0)
+  {
+    if(lineReady)
+    {
+      queue->Put(line, FILE_SOURCE, lineStart);
+      lineReady = false;
+      lineStart = nextLineStart;
+      continue;
+    }
+
+    if(blockPointer >= blockLength[current])
     {
-      gcodeBuffer[gcodePointer] = 0;
-      gcodePointer = 0;
-      ActOnGcode();
-      gcodeBuffer[0] = 0;
+      if(blockLength[back])
+      {
+        blockLength[current] = 0;
+        current = back;
+        back = 1 - current;
+        blockPointer = 0;
+        continue;
+      }
+      if(!endOfFile)
+        return; // Wait for the next block to be read
+      if(!linePointer)
+      {
+        Finish();
+        return;
+      }
+      c = '\n'; // The last line has no newline
     } else
-      gcodePointer++;
-    
-    if(gcodePointer >= GCODE_LENGTH)
+      c = blocks[current][blockPointer++];
+
+    if(c != '\n' && c != '\r')
+    {
+      if(linePointer < GCODE_LENGTH - 1)
+        line[linePointer++] = c;
+      continue;
+    }
+
+    line[linePointer] = 0;
+    lineReady = linePointer > 0 && line[0] != ';';
+    linePointer = 0;
+    nextLineStart = blockStart[current] + blockPointer;
+    if(!lineReady)
+      lineStart = nextLineStart;
+  }
+}
+
+//*****************************************************************************************************
+
+GCodeRecord::GCodeRecord()
+{
+  seen = 0;
+  string = "";
+}
+
+// M Codes whose argument is a string (file names and messages)
+
+boolean GCodeRecord::TakesString(long mCode)
+{
+  return mCode == 23 || mCode == 28 || mCode == 30 || mCode == 32 || mCode == 117;
+}
+
+// Faster than atof() or strtod() for the numbers in G Codes, which never have
+// exponents.  Digits beyond the ninth significant one are ignored.  p is left
+// pointing at the first character after the number.
+
+float GCodeRecord::ReadNumber(char*& p)
+{
+  static const float powersOfTen[] = {1.0, 10.0, 100.0, 1000.0, 10000.0, 100000.0, 1000000.0,
+                                      10000000.0, 100000000.0, 1000000000.0};
+  boolean negative = false;
+  if(*p == '-')
+  {
+    negative = true;
+    p++;
+  } else if(*p == '+')
+    p++;
+
+  unsigned long mantissa = 0;
+  int digits = 0;
+  int decimals = 0;
+  while(isdigit(*p))
+  {
+    if(digits < 9)
+    {
+      mantissa = 10*mantissa + (*p - '0');
+      if(mantissa)
+        digits++;
+    } else if(decimals > -9)
+      decimals--;
+    p++;
+  }
+  if(*p == '.')
+  {
+    p++;
+    while(isdigit(*p))
+    {
+      if(digits < 9 && decimals < 9)
+      {
+        mantissa = 10*mantissa + (*p - '0');
+        if(mantissa)
+          digits++;
+        decimals++;
+      }
+      p++;
+    }
+  }
+
+  float result = (float)mantissa;
+  if(decimals > 0)
+    result /= powersOfTen[decimals];
+  else if(decimals < 0)
+    result *= powersOfTen[-decimals];
+  return negative ? -result : result;
+}
+
+// Letters not followed by a number are ignored.  An N word and a *checksum may be present;
+// the checksum is the exclusive OR of every character before the '*'.
+
+boolean GCodeRecord::Parse(char* line)
+{
+  seen = 0;
+  string = "";
+  char* p = line;
+  byte checksum = 0;
+  char c;
+  int slot;
+
+  while((c = *p))
+  {
+    if(c == ';')
+      break;
+
+    if(c == '*')
+    {
+      p++;
+      return (byte)ReadNumber(p) == checksum;
+    }
+
+    if(c == '(')
+    {
+      while(*p && *p != ')')
+        checksum ^= *p++;
+      continue;
+    }
+
+    checksum ^= c;
+    p++;
+    if(!isalpha(c) || !(isdigit(*p) || *p == '-' || *p == '+' || *p == '.'))
+      continue;
+
+    slot = Slot(c);
+    char* start = p;
+    values[slot] = ReadNumber(p);
+    seen |= 1ul << slot;
+    while(start < p)
+      checksum ^= *start++;
+
+    if(slot == Slot('M') && TakesString(IValue('M')))
     {
-      platform->Message(HOST_MESSAGE, "GCodes: G Code buffer length overflow.");
-      gcodePointer = 0;
-      gcodeBuffer[0] = 0;
+      while(*p == ' ')
+        checksum ^= *p++;
+      string = p;
+      while(*p && *p != '*' && *p != ';')
+        checksum ^= *p++;
+      if(*p == '*')
+      {
+        char* end = p;
+        p++;
+        boolean ok = (byte)ReadNumber(p) == checksum;
+        while(end > string && isspace(end[-1]))
+          end--;
+        *end = 0;
+        return ok;
+      }
+      while(p > string && isspace(p[-1]))
+        p--;
+      *p = 0;
+      return true;
     }
   }
+  return true;
 }
 
+//*****************************************************************************************************
+
+GCodeSidecar::GCodeSidecar()
+{
+  loaded = false;
+}
+
+void GCodeSidecar::Init(Platform* p)
+{
+  platform = p;
+  loaded = false;
+}
+
+void GCodeSidecar::Start()
+{
+  data.magic = SIDECAR_MAGIC;
+  data.fileLength = 0;
+  data.lines = 0;
+  data.lineStride = 1;
+  data.lineEntries = 0;
+  data.layers = 0;
+  data.layerStride = 1;
+  data.layerEntries = 0;
+  data.filament = 0.0;
+  data.duration = 0.0;
+  loaded = false;
+  linePointer = 0;
+  scanned = 0;
+  lineStart = 0;
+  for(int i = 0; i < DRIVES; i++)
+    position[i] = 0.0;
+  feedRate = platform->MaxFeedrate(X_AXIS);
+  distanceScale = 1.0;
+  axesRelative = false;
+  extrudersRelative = platform->DriveRelativeMode(AXES);
+  layerZ = 0.0;
+  heightStart = 0;
+}
+
+void GCodeSidecar::Scan(char* b, int length)
+{
+  char c;
+  for(int i = 0; i < length; i++)
+  {
+    c = b[i];
+    scanned++;
+    if(c == '\n')
+    {
+      EndLine();
+      lineStart = scanned;
+    } else if(c != '\r' && linePointer < GCODE_LENGTH - 1)
+      line[linePointer++] = c;
+  }
+}
+
+void GCodeSidecar::EndLine()
+{
+  line[linePointer] = 0;
+  linePointer = 0;
+  Add(data.lineOffsets, data.lineEntries, data.lineStride, SIDECAR_LINES, data.lines, lineStart);
+  data.lines++;
+  if(!record.Parse(line) || record.Empty())
+    return;
+
+  if(record.Seen('G'))
+  {
+    switch(record.IValue('G'))
+    {
+    case 0:
+    case 1:
+    case 2: // Arcs are taken as straight - near enough for an estimate
+    case 3:
+      ScanMove();
+      break;
+
+    case 4:
+      if(record.Seen('P'))
+        data.duration += 0.001*record.Value('P');
+      if(record.Seen('S'))
+        data.duration += record.Value('S');
+      break;
+
+    case 20:
+      distanceScale = INCH;
+      break;
+
+    case 21:
+      distanceScale = 1.0;
+      break;
+
+    case 90:
+      axesRelative = false;
+      break;
+
+    case 91:
+      axesRelative = true;
+      break;
+
+    case 92:
+      for(int i = 0; i < DRIVES; i++)
+      {
+        if(record.Seen(gCodeLetters[i]))
+          position[i] = record.Value(gCodeLetters[i])*distanceScale;
+      }
+      break;
+
+    default:
+      break;
+    }
+  } else if(record.Seen('M'))
+  {
+    if(record.IValue('M') == 82)
+      extrudersRelative = false;
+    else if(record.IValue('M') == 83)
+      extrudersRelative = true;
+  }
+}
+
+void GCodeSidecar::ScanMove()
+{
+  float d2 = 0.0;
+  float extruded = 0.0;
+  float v, d;
+  for(int i = 0; i < DRIVES; i++)
+  {
+    if(!record.Seen(gCodeLetters[i]))
+      continue;
+    v = record.Value(gCodeLetters[i])*distanceScale;
+    if(i < AXES ? axesRelative : extrudersRelative)
+      v += position[i];
+    d = v - position[i];
+    position[i] = v;
+    if(i < AXES)
+      d2 += d*d;
+    else
+      extruded += d;
+  }
+  if(record.Seen('F') && record.Value('F') > 0.0)
+    feedRate = record.Value('F')*distanceScale/60.0;
+
+  if(record.Seen(gCodeLetters[Z_AXIS]))
+    heightStart = lineStart;
+  d = sqrt(d2);
+  if(d <= 0.0)
+    d = fabs(extruded);
+  if(feedRate > 0.0)
+    data.duration += d/feedRate;
+  data.filament += extruded;
+  if(extruded > 0.0 && (!data.layers || position[Z_AXIS] != layerZ))
+  {
+    Add(data.layerOffsets, data.layerEntries, data.layerStride, SIDECAR_LAYERS, data.layers, heightStart);
+    data.layers++;
+    layerZ = position[Z_AXIS];
+  }
+}
+
+// Record where item n starts if it's one the table keeps
+
+void GCodeSidecar::Add(unsigned long table[], int& entries, long& stride, int size, long n, unsigned long offset)
+{
+  if(n % stride)
+    return;
+  if(entries >= size)
+  {
+    for(int i = 0; i < size/2; i++)
+      table[i] = table[2*i];
+    entries = size/2;
+    stride *= 2;
+    if(n % stride)
+      return;
+  }
+  table[entries++] = offset;
+}
+
+// The number of the last recorded item starting at or before offset; -1 if there isn't one
+
+long GCodeSidecar::Find(unsigned long table[], int entries, long stride, unsigned long offset)
+{
+  if(!entries || offset < table[0])
+    return -1;
+  int low = 0;
+  int high = entries - 1;
+  int mid;
+  while(low < high)
+  {
+    mid = (low + high + 1)/2;
+    if(table[mid] <= offset)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return low*stride;
+}
+
+unsigned long GCodeSidecar::LayerOffset(long& layer)
+{
+  int k = layer/data.layerStride;
+  if(k >= data.layerEntries)
+    k = data.layerEntries - 1;
+  layer = k*data.layerStride;
+  return data.layerOffsets[k];
+}
+
+// The sidecar's full name from the G Code file's name, with or without the G Code directory
+
+char* GCodeSidecar::SidecarName(char* fileName)
+{
+  char* dir = platform->GetGcodeDir();
+  if(!strncmp(fileName, dir, strlen(dir)))
+    fileName += strlen(dir);
+  snprintf(sidecarName, GCODE_LENGTH, "%s%s/%s", platform->GetSysDir(), SIDECAR_DIR, fileName);
+  return sidecarName;
+}
+
+boolean GCodeSidecar::Save(char* fileName)
+{
+  if(linePointer)
+  {
+    EndLine(); // The last line has no newline
+    lineStart = scanned;
+  }
+  data.fileLength = scanned;
+  char* name = SidecarName(fileName);
+  platform->DeleteFile(name);
+  int file = platform->OpenFile(name, true);
+  if(file < 0)
+    return false;
+  platform->Write(file, (char*)&data, sizeof(SidecarData));
+  platform->Close(file);
+  loaded = true;
+  return true;
+}
+
+boolean GCodeSidecar::Load(char* fileName, unsigned long fileLength)
+{
+  loaded = false;
+  char* name = SidecarName(fileName);
+  if(!SD.exists(name))
+    return false;
+  int file = platform->OpenFile(name, false);
+  if(file < 0)
+    return false;
+  int n = platform->Read(file, (char*)&data, sizeof(SidecarData));
+  platform->Close(file);
+  loaded = n == sizeof(SidecarData) && data.magic == SIDECAR_MAGIC && data.fileLength == fileLength;
+  return loaded;
+}
+
+void GCodeSidecar::Remove(char* fileName)
+{
+  platform->DeleteFile(SidecarName(fileName));
+}
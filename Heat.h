@@ -21,14 +21,51 @@ Licence: GPL
 #ifndef HEAT_H
 #define HEAT_H
 
+// Control of one heater, run every TEMP_INTERVAL.  Heaters flagged for PID are driven by a PID loop
+// whose integral term is clamped to the heater's limit and stops growing while the output is
+// saturated, so it doesn't wind up during a long heat-up.  The others are switched on and off around
+// the target.  An autotune makes the heater oscillate about a temperature by switching it fully on and
+// off, and works out PID constants from the period and size of the swings (Ziegler-Nichols).
+
 class PID
 {
   public:
   
     PID();
+    void Init(Platform* p, byte h);
+    void Spin();
+    void SetTemperature(float t); // 0 or less turns the heater off
+    float GetTemperature();
+    float GetTarget(); // 0 or less if the heater is off
+    boolean AtTemperature();
+    void AutoTune(float t, int cycles);
+    boolean AutoTuning();
     
   private:
   
+    void BangBang();
+    void Tune();
+    void FinishTuning();
+  
+    Platform* platform;
+    byte heater;
+    float target;
+    float temperature;
+    float lastTemperature;
+    float integral; // The I term, in the same units as PID_MAX
+    boolean heating; // Bang-bang and autotune state
+    long ticks; // TEMP_INTERVALs since Init()
+    boolean tuning;
+    int tuneCycles; // Oscillations still to be measured
+    int tuneSwitches; // Times the heater has been switched on during the tune
+    long tuneStart;
+    long cycleStart;
+    float tuneHigh;
+    float tuneLow;
+    long periodSum; // In TEMP_INTERVALs
+    float amplitudeSum;
+    int measured;
+    char tuneString[STATUS_LENGTH];
 };
 
 class Heat
@@ -40,16 +77,59 @@ class Heat
     void Spin();
     void Init();
     void Exit();
+    void SetTemperature(byte heater, float t);
+    float GetTemperature(byte heater);
+    float GetTarget(byte heater);
+    boolean AtTemperature(byte heater);
+    void AutoTune(byte heater, float t, int cycles);
     
   private:
   
   Platform* platform;
   boolean active;
-  unsigned long lastTime;
-  //float frac;
-  //float inc;
-  
+  PID pids[HEATERS];
 };
 
+//*****************************************************************************************************
+
+inline float PID::GetTemperature()
+{
+  return temperature;
+}
+
+inline float PID::GetTarget()
+{
+  return target;
+}
+
+inline boolean PID::AutoTuning()
+{
+  return tuning;
+}
+
+inline void Heat::SetTemperature(byte heater, float t)
+{
+  pids[heater].SetTemperature(t);
+}
+
+inline float Heat::GetTemperature(byte heater)
+{
+  return pids[heater].GetTemperature();
+}
+
+inline float Heat::GetTarget(byte heater)
+{
+  return pids[heater].GetTarget();
+}
+
+inline boolean Heat::AtTemperature(byte heater)
+{
+  return pids[heater].AtTemperature();
+}
+
+inline void Heat::AutoTune(byte heater, float t, int cycles)
+{
+  pids[heater].AutoTune(t, cycles);
+}
 
 #endif
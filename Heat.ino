@@ -29,35 +29,225 @@ Heat::Heat(Platform* p)
 
 void Heat::Init()
 {
-  lastTime = platform->Time();
-  //frac = 0;
-  //inc = 0.01;
+  for(byte heater = 0; heater < HEATERS; heater++)
+    pids[heater].Init(platform, heater);
   active = true; 
 }
 
 void Heat::Exit()
 {
+  for(byte heater = 0; heater < HEATERS; heater++)
+    pids[heater].SetTemperature(0.0);
   active = false;
 }
 
+// Called every TEMP_INTERVAL by the scheduler
+
 void Heat::Spin()
 {
   if(!active)
     return;
     
-   unsigned long t = platform->Time();
-   if(t - lastTime < 3000)
-     return;
-   lastTime = t;
-/*   if(frac > 1 || frac < 0)
-   {
-     inc = -inc;
-     //Serial.print("Temps: ");
-     //Serial.print(platform->getTemperature(0));
-    // Serial.print(", ");
-     //Serial.println(platform->getTemperature(1));
-   }
-   platform->setHeater(0, frac);
-   platform->setHeater(1, 1 - frac);
-   frac += inc;*/
+   for(byte heater = 0; heater < HEATERS; heater++)
+     pids[heater].Spin();
+}
+
+//*****************************************************************************************************
+
+PID::PID()
+{
+  target = 0.0;
+  tuning = false;
+}
+
+void PID::Init(Platform* p, byte h)
+{
+  platform = p;
+  heater = h;
+  target = 0.0;
+  temperature = platform->GetTemperature(heater);
+  lastTemperature = temperature;
+  integral = 0.0;
+  heating = false;
+  ticks = 0;
+  tuning = false;
+  platform->SetHeater(heater, 0.0);
+}
+
+void PID::SetTemperature(float t)
+{
+  if(tuning)
+  {
+    platform->Message(HOST_MESSAGE, "Heater autotune abandoned.<br>\n", LOG_WARNING);
+    tuning = false;
+  }
+  target = t;
+}
+
+boolean PID::AtTemperature()
+{
+  if(tuning)
+    return false;
+  if(target <= 0.0)
+    return true;
+  return fabs(temperature - target) <= TEMP_CLOSE_ENOUGH;
+}
+
+// Called every TEMP_INTERVAL.  The derivative is taken from the temperature rather than the
+// error, so changing the target doesn't kick the output.
+
+void PID::Spin()
+{
+  lastTemperature = temperature;
+  temperature = platform->GetTemperature(heater);
+  ticks++;
+  
+  if(tuning)
+  {
+    Tune();
+    return;
+  }
+  
+  if(target <= 0.0)
+  {
+    integral = 0.0;
+    platform->SetHeater(heater, 0.0);
+    return;
+  }
+  
+  if(!platform->UsePID(heater))
+  {
+    BangBang();
+    return;
+  }
+  
+  float error = target - temperature;
+  float p = platform->PidKp(heater)*error;
+  float d = platform->PidKd(heater)*(temperature - lastTemperature)/TEMP_INTERVAL;
+  float i = integral + platform->PidKi(heater)*error*TEMP_INTERVAL;
+  if(i > platform->PidILimit(heater))
+    i = platform->PidILimit(heater);
+  if(i < 0.0)
+    i = 0.0;
+  
+  // Only let the integral move further in the direction the output is already saturated in
+  // if that brings the output back into range
+  
+  float result = p + i - d;
+  if((result < PID_MAX || i < integral) && (result > 0.0 || i > integral))
+    integral = i;
+  result = p + integral - d;
+  platform->SetHeater(heater, result/PID_MAX);
+}
+
+void PID::BangBang()
+{
+  if(heating)
+  {
+    if(temperature > target + TEMP_HYSTERESIS)
+      heating = false;
+  } else if(temperature < target - TEMP_HYSTERESIS)
+    heating = true;
+  platform->SetHeater(heater, heating ? 1.0 : 0.0);
+}
+
+// Start a relay-feedback autotune about temperature t, measuring the given number of oscillations.
+
+void PID::AutoTune(float t, int cycles)
+{
+  if(t <= 0.0 || cycles < 1)
+  {
+    platform->Message(HOST_MESSAGE, "Heater autotune needs a temperature and at least one cycle.<br>\n", LOG_ERROR);
+    return;
+  }
+  target = t;
+  tuneCycles = cycles;
+  tuneSwitches = 0;
+  tuneStart = ticks;
+  cycleStart = ticks;
+  tuneHigh = temperature;
+  tuneLow = temperature;
+  periodSum = 0;
+  amplitudeSum = 0.0;
+  measured = 0;
+  heating = true;
+  tuning = true;
+  platform->Message(HOST_MESSAGE, "Heater autotune started.<br>\n");
+}
+
+// A cycle runs from one switch-on to the next.  The first cycle is the heat-up and the second
+// may still be settling, so neither is measured.
+
+void PID::Tune()
+{
+  if((ticks - tuneStart)*TEMP_INTERVAL > AUTOTUNE_TIMEOUT)
+  {
+    platform->Message(HOST_MESSAGE, "Heater autotune timed out.<br>\n", LOG_ERROR);
+    tuning = false;
+    target = 0.0;
+    platform->SetHeater(heater, 0.0);
+    return;
+  }
+  
+  if(temperature > tuneHigh)
+    tuneHigh = temperature;
+  if(temperature < tuneLow)
+    tuneLow = temperature;
+    
+  if(heating)
+  {
+    if(temperature > target + TEMP_HYSTERESIS)
+      heating = false;
+  } else if(temperature < target - TEMP_HYSTERESIS)
+  {
+    heating = true;
+    if(tuneSwitches > 1)
+    {
+      periodSum += ticks - cycleStart;
+      amplitudeSum += 0.5*(tuneHigh - tuneLow);
+      measured++;
+      tuneCycles--;
+    }
+    tuneSwitches++;
+    cycleStart = ticks;
+    tuneHigh = temperature;
+    tuneLow = temperature;
+    if(!tuneCycles)
+    {
+      FinishTuning();
+      return;
+    }
+  }
+  platform->SetHeater(heater, heating ? 1.0 : 0.0);
+}
+
+// The relay swings the output by PID_MAX/2 either side of its mean, and has hysteresis, so the
+// ultimate gain is 4(PID_MAX/2)/(pi*sqrt(a^2 - h^2)) for a swing of +/-a.  The heater is left off.
+
+void PID::FinishTuning()
+{
+  tuning = false;
+  target = 0.0;
+  platform->SetHeater(heater, 0.0);
+  
+  float period = (float)periodSum*TEMP_INTERVAL/(float)measured;
+  float amplitude = amplitudeSum/(float)measured;
+  amplitude = amplitude*amplitude - TEMP_HYSTERESIS*TEMP_HYSTERESIS;
+  if(amplitude <= 0.0 || period <= 0.0)
+  {
+    platform->Message(HOST_MESSAGE, "Heater autotune failed: the temperature hardly changed.<br>\n", LOG_ERROR);
+    return;
+  }
+  float ku = 2.0*PID_MAX/(PI*sqrt(amplitude));
+  float kp = 0.6*ku;
+  float ki = 2.0*kp/period;
+  float kd = kp*period/8.0;
+  platform->SetPid(heater, kp, ki, kd);
+  
+  long p = (long)(1000.0*kp + 0.5);
+  long i = (long)(1000.0*ki + 0.5);
+  long d = (long)(1000.0*kd + 0.5);
+  snprintf(tuneString, STATUS_LENGTH, "Heater %d autotuned: P%ld.%03ld I%ld.%03ld D%ld.%03ld<br>\n", heater,
+    p/1000, p%1000, i/1000, i%1000, d/1000, d%1000);
+  platform->Message(HOST_MESSAGE, tuneString);
 }
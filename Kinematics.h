@@ -0,0 +1,217 @@
+/****************************************************************************************************
+
+RepRapFirmware - Kinematics
+
+Vectors of positions, and the transforms from the machine's position (mm in X, Y, Z and along each
+extruder) to the positions of its motors (mm of belt, screw or filament), for each kind of machine.
+Which one is used is chosen by KINEMATICS in Platform.h.  They are all classes with nothing but
+inline static functions, so the choice costs nothing at run time and the transform is compiled
+into the move planner where it's called.
+
+A kinematics class has:
+
+  static void Transform(const Vec<DRIVES>& position, Vec<DRIVES>& motors); // Where the motors are for a position
+  static float SegmentLength(); // Straight moves are cut into pieces this long (mm) first; 0 for never
+
+Moves are straight in X, Y and Z.  If the motors don't move linearly along them (as in a delta)
+the moves are cut into short segments, each of which is near enough straight in the motors' space.
+
+-----------------------------------------------------------------------------------------------------
+
+Version 0.1
+
+18 November 2012
+
+Adrian Bowyer
+RepRap Professional Ltd
+http://reprappro.com
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef KINEMATICS_H
+#define KINEMATICS_H
+
+// A vector of N floats with the usual algebra.  Vec<DRIVES> holds a position of all the drives,
+// Vec<AXES> one in space.
+
+template<int N> class Vec
+{
+  public:
+
+    Vec();
+    Vec(float f[]);
+    float& operator[](int i);
+    float operator[](int i) const;
+    Vec<N> operator+(const Vec<N>& b) const;
+    Vec<N> operator-(const Vec<N>& b) const;
+    Vec<N> operator*(float s) const;
+    Vec<N> operator/(float s) const;
+    float operator*(const Vec<N>& b) const; // Dot product
+    float Length() const;
+    void Get(float f[]) const;
+
+  private:
+
+    float v[N];
+};
+
+// The axes drive X, Y and Z directly
+
+class Cartesian
+{
+  public:
+
+    static void Transform(const Vec<DRIVES>& position, Vec<DRIVES>& motors);
+    static float SegmentLength();
+};
+
+// The X and Y motors drive one belt between them: X moves both the same way, and Y moves them
+// opposite ways.
+
+class CoreXY
+{
+  public:
+
+    static void Transform(const Vec<DRIVES>& position, Vec<DRIVES>& motors);
+    static float SegmentLength();
+};
+
+// Three carriages on vertical towers, each joined to the effector by a pair of rods of length
+// DELTA_DIAGONAL_ROD.  The towers are DELTA_RADIUS from the centre (allowing for the offsets of
+// the rods' joints on the carriages and on the effector) at 210, 330 and 90 degrees.  The axis
+// drives are the carriages; the rest are extruders as usual.
+
+class LinearDelta
+{
+  public:
+
+    static void Transform(const Vec<DRIVES>& position, Vec<DRIVES>& motors);
+    static float SegmentLength();
+};
+
+typedef KINEMATICS Kinematics;
+
+//*******************************************************************************************
+
+template<int N> inline Vec<N>::Vec()
+{
+  for(int i = 0; i < N; i++)
+    v[i] = 0.0;
+}
+
+template<int N> inline Vec<N>::Vec(float f[])
+{
+  for(int i = 0; i < N; i++)
+    v[i] = f[i];
+}
+
+template<int N> inline float& Vec<N>::operator[](int i)
+{
+  return v[i];
+}
+
+template<int N> inline float Vec<N>::operator[](int i) const
+{
+  return v[i];
+}
+
+template<int N> inline Vec<N> Vec<N>::operator+(const Vec<N>& b) const
+{
+  Vec<N> r;
+  for(int i = 0; i < N; i++)
+    r.v[i] = v[i] + b.v[i];
+  return r;
+}
+
+template<int N> inline Vec<N> Vec<N>::operator-(const Vec<N>& b) const
+{
+  Vec<N> r;
+  for(int i = 0; i < N; i++)
+    r.v[i] = v[i] - b.v[i];
+  return r;
+}
+
+template<int N> inline Vec<N> Vec<N>::operator*(float s) const
+{
+  Vec<N> r;
+  for(int i = 0; i < N; i++)
+    r.v[i] = v[i]*s;
+  return r;
+}
+
+template<int N> inline Vec<N> Vec<N>::operator/(float s) const
+{
+  return *this*(1.0/s);
+}
+
+template<int N> inline float Vec<N>::operator*(const Vec<N>& b) const
+{
+  float d = 0.0;
+  for(int i = 0; i < N; i++)
+    d += v[i]*b.v[i];
+  return d;
+}
+
+template<int N> inline float Vec<N>::Length() const
+{
+  return sqrt(*this**this);
+}
+
+template<int N> inline void Vec<N>::Get(float f[]) const
+{
+  for(int i = 0; i < N; i++)
+    f[i] = v[i];
+}
+
+//*******************************************************************************************
+
+inline void Cartesian::Transform(const Vec<DRIVES>& position, Vec<DRIVES>& motors)
+{
+  motors = position;
+}
+
+inline float Cartesian::SegmentLength()
+{
+  return 0.0;
+}
+
+inline void CoreXY::Transform(const Vec<DRIVES>& position, Vec<DRIVES>& motors)
+{
+  motors = position;
+  motors[X_AXIS] = position[X_AXIS] + position[Y_AXIS];
+  motors[Y_AXIS] = position[X_AXIS] - position[Y_AXIS];
+}
+
+inline float CoreXY::SegmentLength()
+{
+  return 0.0;
+}
+
+// Each carriage is as far above the effector as the rods reach at the effector's horizontal
+// distance from that tower.  Positions the rods can't reach are taken to be at full stretch.
+
+inline void LinearDelta::Transform(const Vec<DRIVES>& position, Vec<DRIVES>& motors)
+{
+  const float towerX[AXES] = {-0.8660254*DELTA_RADIUS, 0.8660254*DELTA_RADIUS, 0.0};
+  const float towerY[AXES] = {-0.5*DELTA_RADIUS, -0.5*DELTA_RADIUS, DELTA_RADIUS};
+  float dx, dy, h2;
+  motors = position;
+  for(int i = 0; i < AXES; i++)
+  {
+    dx = position[X_AXIS] - towerX[i];
+    dy = position[Y_AXIS] - towerY[i];
+    h2 = DELTA_DIAGONAL_ROD*DELTA_DIAGONAL_ROD - dx*dx - dy*dy;
+    if(h2 < 0.0)
+      h2 = 0.0;
+    motors[i] = position[Z_AXIS] + sqrt(h2);
+  }
+}
+
+inline float LinearDelta::SegmentLength()
+{
+  return DELTA_SEGMENT_LENGTH;
+}
+
+#endif
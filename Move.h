@@ -4,6 +4,29 @@ RepRapFirmware - Move
 
 This is all the code to deal with movement and kinematics.
 
+Moves are queued in a ring of LOOK_AHEAD entries.  Each new move gets a maximum speed at its
+junction with the one before it from the drives' jerks, and then a backward pass (from the newest
+move, which must end at rest) and a forward pass (from the oldest) settle the entry speed of every
+queued move.  The oldest move's entry speed never changes, as the move before it has already been
+committed to that speed at its end.  When a move is taken from the ring its exit speed is the entry
+speed of the move behind it, so it can be given a trapezoidal velocity profile.
+
+The planner works in X, Y and Z, and the limits on each drive's speed, acceleration and jerk are
+applied to the motors' movements as found by the kinematics (see Kinematics.h).  If the kinematics
+isn't linear the moves are cut into short segments as they're queued.
+
+If the bed has been probed (G29) the height of the bed under the nozzle is added to Z before the
+kinematics.  The bed is a grid of bilinear patches, and moves are also cut where they cross from
+one patch to the next, so each piece only has to be compensated at its ends.
+
+That profile is turned into a DDA - step counts for each drive and the intervals between steps -
+in the main loop, and the DDAs are then stepped out from the step timer interrupt.
+
+When simulating, the moves are planned and turned into DDAs in just the same way, but nothing is
+stepped; a move is taken from the ring as soon as another needs its place, as it would be by a
+machine that kept up, and the ring is only emptied when no more moves are coming.  Adding up each
+move's duration as it is taken gives the time a print would take, as fast as the planner can go.
+
 -----------------------------------------------------------------------------------------------------
 
 Version 0.1
@@ -21,20 +44,416 @@ Licence: GPL
 #ifndef MOVE_H
 #define MOVE_H
 
+// One planned move - all speeds in mm/sec, distances in mm
+
+class LookAhead
+{
+  public:
+
+    LookAhead();
+    void Init(float from[], float to[], Vec<DRIVES>& motorFrom, Vec<DRIVES>& motorTo, float feedRate, Platform* p);
+    float Distance();
+    float FeedRate();
+    float Acceleration();
+    float EntrySpeed();
+    void SetEntrySpeed(float s);
+    float MaxEntrySpeed();
+    void SetMaxEntrySpeed(float s);
+    float JunctionSpeed(LookAhead* next, Platform* p); // Fastest speed across the join with the next move
+    float ReachableSpeed(float v); // Speed at the other end after accelerating from v along the whole move
+    void Trapezoid(float exitSpeed, float& accelDistance, float& decelDistance, float& topSpeed);
+    float Duration(float exitSpeed); // Seconds to do the move
+    Vec<DRIVES>& EndPoint();
+    Vec<DRIVES>& MotorEndPoint(); // Where the motors are at the end
+    void SetEndstop(int axis, bool direction); // Stop when this endstop is hit
+    int EndstopAxis(); // -1 if the move doesn't stop for an endstop
+    bool EndstopDirection();
+    void SetFileOffset(unsigned long offset);
+    unsigned long FileOffset(); // Where the line the move is for starts in the file being printed
+
+  private:
+
+    Vec<DRIVES> endPoint;
+    Vec<DRIVES> motorEndPoint;
+    Vec<DRIVES> unit; // mm each motor moves per mm of the move
+    float distance;
+    float feedRate;
+    float acceleration;
+    float entrySpeed;
+    float maxEntrySpeed;
+    int endstopAxis;
+    bool endstopDirection;
+    unsigned long fileOffset;
+};
+
+// One move turned into steps.  Init() does all the floating-point work in the main loop;
+// Step() is called from the step interrupt and uses only integer arithmetic.  The drives
+// are kept in step with each other by Bresenham's algorithm, and the interval between steps
+// on the ramps comes from the recurrence c[n] = c[n-1] - 2c[n-1]/(4n + 1) (see D. Austin,
+// "Generate stepper-motor speed profiles in real time", 2005).
+
+class DDA
+{
+  public:
+
+    DDA();
+    boolean Init(LookAhead* la, float exitSpeed, long position[], Platform* p); // Updates position; false if there is nothing to step
+    boolean Step(); // Make one step and set the next interrupt; false when the move is finished
+    boolean EndstopHit(); // Did the move finish early at an endstop?
+    float Unstep(long position[]); // Take the steps not made off the position it was to finish at; returns the fraction made
+    unsigned long FileOffset();
+
+  private:
+
+    Platform* platform;
+    long delta[DRIVES];
+    boolean directions[DRIVES];
+    long counter[DRIVES];
+    long totalSteps;
+    long stepCount;
+    long accelStopStep;
+    long decelStartStep;
+    long rampIndex;
+    long decelRampIndex;
+    unsigned long interval; // Step clock ticks
+    unsigned long topInterval;
+    int endstopAxis;
+    bool endstopDirection;
+    boolean endstopHit;
+    unsigned long fileOffset;
+};
+
+// The height of the bed above Z = 0, from heights probed on a BED_GRID x BED_GRID grid that covers
+// the X and Y axes but for BED_PROBE_MARGIN round the edges.  Each cell of the grid is a bilinear
+// patch z = a + bx + cy + dxy, with its coefficients worked out once when the heights are set, so
+// finding a height takes a lookup and a few multiply-adds.  Beyond the outermost probe points the
+// patches at the edge are carried on.
+
+class BedMesh
+{
+  public:
+
+    BedMesh();
+    void Init(Platform* p); // Size the grid from the axis lengths; there is no compensation until Set()
+    void ProbePoint(int point, float& x, float& y); // Where heights are probed; X varies fastest
+    void Set(float heights[]); // The height at each probe point, in the same order
+    void Clear(); // Stop compensating
+    boolean Active();
+    float Height(float x, float y);
+    float NextCrossing(const Vec<DRIVES>& from, const Vec<DRIVES>& to, float t); // The fraction of the way along a move where it next enters another cell after t; 1.0 if it doesn't
+
+  private:
+
+    void Crossing(float a, float b, float origin, float step, float t, float& next);
+
+    boolean active;
+    float x0, y0; // The first probe point...
+    float xStep, yStep; // ...and the gaps between them
+    float xScale, yScale; // 1/gap
+    float cells[BED_GRID - 1][BED_GRID - 1][4]; // [y][x] - a, b, c and d for each patch
+};
+
 class Move
-{   
+{
   public:
-  
+
     Move(Platform* p);
     void Init();
     void Spin();
     void Exit();
-    
+    void Interrupt();
+    boolean AddMove(float to[], float feedRate); // Queue a move to absolute position to[] (mm) at feedRate (mm/sec); false if no room
+    boolean AddHomingMove(float to[], float feedRate, int axis, bool direction); // The same, stopping at an endstop; only when Idle()
+    boolean EndstopHit(); // Did the last homing move find its endstop?  If it did, the last position is where it stopped.
+    boolean QueueFull(); // No room for another move
+    boolean QueueEmpty();
+    int QueueDepth();
+    boolean Idle(); // Nothing queued and nothing moving
+    void GetLastPosition(float m[]); // Where the last queued move finishes
+    void SetLastPosition(float m[]); // Redefine that (e.g. for G92) - only when Idle()
+    unsigned long MaxStepLatency(); // Worst step interrupt lateness seen, in step clock ticks
+    void Simulate(boolean on); // Plan moves without making them; only when Idle()
+    boolean Simulating();
+    void ResetStatistics();
+    unsigned long MovesDone(); // Moves taken from the ring...
+    float MoveTime(); // ...the seconds they take...
+    int QueuePeak(); // ...and the most that were waiting at once, since ResetStatistics()
+    BedMesh* GetBedMesh();
+    void SetBedMesh(float heights[]); // Start compensating for the bed's shape (see BedMesh); only when Idle()
+    void ClearBedMesh(); // Stop; only when Idle()
+    void SetFileOffset(unsigned long offset); // Moves added from now on are for the line that starts here in the file being printed...
+    unsigned long FileOffset(); // ...and this is that of the oldest move not yet finished; NO_FILE_OFFSET if there isn't one
+
   private:
-  
+
+    int Next(int i);
+    int Previous(int i);
+    int DDANext(int i);
+    void Recalculate();
+    boolean NextMove();
+    boolean AddLookAhead(float to[], float feedRate, unsigned long offset);
+    void QueueSegments(); // As many of the move being segmented as there's room for
+    boolean RingFull();
+    void MotorPosition(const Vec<DRIVES>& position, Vec<DRIVES>& motors); // Compensate for the bed, then transform
+    void EndstopStopped(); // Put the positions where the homing move stopped
+    void MotorsToSteps(); // Take the last motor position from the step counts
+
     Platform* platform;
-    unsigned long lastTime;
     boolean active;
+
+    LookAhead lookAheadRing[LOOK_AHEAD];
+    int addPointer;
+    int readPointer;
+    float lastPosition[DRIVES];
+    Vec<DRIVES> lastMotorPosition;
+    Vec<DRIVES> segmentStart; // The move being cut into segments...
+    Vec<DRIVES> segmentEnd;
+    float segmentFeedRate;
+    unsigned long segmentOffset;
+    int segments; // ...the number of them...
+    int segment; // ...how many have been queued...
+    float segmentFraction; // ...and how far along the move, counting pieces cut at the bed's cells
+    BedMesh bedMesh;
+    float homingStart[DRIVES];
+    unsigned long fileOffset;
+
+    boolean simulating;
+    boolean added; // A move has been added since the last Spin()
+    float savedPosition[DRIVES]; // Where the machine really was when simulation started
+    unsigned long movesDone;
+    float moveTime;
+    int queuePeak;
+
+    DDA ddaRing[DDA_RING_LENGTH];
+    volatile int ddaAddPointer;
+    volatile int ddaReadPointer;
+    DDA* currentDDA;
+    volatile boolean stepping;
+    long stepPosition[DRIVES];
+    volatile unsigned long maxStepLatency;
+    volatile boolean endstopHit;
+    DDA* volatile stoppedDDA; // Stopped at its endstop, and the positions haven't caught up yet
 };
 
+//*******************************************************************************************
+
+inline float LookAhead::Distance()
+{
+  return distance;
+}
+
+inline float LookAhead::FeedRate()
+{
+  return feedRate;
+}
+
+inline float LookAhead::Acceleration()
+{
+  return acceleration;
+}
+
+inline float LookAhead::EntrySpeed()
+{
+  return entrySpeed;
+}
+
+inline void LookAhead::SetEntrySpeed(float s)
+{
+  entrySpeed = s;
+}
+
+inline float LookAhead::MaxEntrySpeed()
+{
+  return maxEntrySpeed;
+}
+
+inline void LookAhead::SetMaxEntrySpeed(float s)
+{
+  maxEntrySpeed = s;
+}
+
+inline float LookAhead::ReachableSpeed(float v)
+{
+  return sqrt(v*v + 2.0*acceleration*distance);
+}
+
+inline Vec<DRIVES>& LookAhead::EndPoint()
+{
+  return endPoint;
+}
+
+inline Vec<DRIVES>& LookAhead::MotorEndPoint()
+{
+  return motorEndPoint;
+}
+
+inline void LookAhead::SetEndstop(int axis, bool direction)
+{
+  endstopAxis = axis;
+  endstopDirection = direction;
+}
+
+inline int LookAhead::EndstopAxis()
+{
+  return endstopAxis;
+}
+
+inline bool LookAhead::EndstopDirection()
+{
+  return endstopDirection;
+}
+
+inline void LookAhead::SetFileOffset(unsigned long offset)
+{
+  fileOffset = offset;
+}
+
+inline unsigned long LookAhead::FileOffset()
+{
+  return fileOffset;
+}
+
+//*******************************************************************************************
+
+inline boolean DDA::EndstopHit()
+{
+  return endstopHit;
+}
+
+inline unsigned long DDA::FileOffset()
+{
+  return fileOffset;
+}
+
+//*******************************************************************************************
+
+inline boolean BedMesh::Active()
+{
+  return active;
+}
+
+inline float BedMesh::Height(float x, float y)
+{
+  int i = (int)((x - x0)*xScale);
+  if(i < 0)
+    i = 0;
+  else if(i > BED_GRID - 2)
+    i = BED_GRID - 2;
+  int j = (int)((y - y0)*yScale);
+  if(j < 0)
+    j = 0;
+  else if(j > BED_GRID - 2)
+    j = BED_GRID - 2;
+  float* c = cells[j][i];
+  return c[0] + c[1]*x + (c[2] + c[3]*x)*y;
+}
+
+//*******************************************************************************************
+
+inline int Move::Next(int i)
+{
+  i++;
+  if(i >= LOOK_AHEAD)
+    i = 0;
+  return i;
+}
+
+inline int Move::Previous(int i)
+{
+  i--;
+  if(i < 0)
+    i = LOOK_AHEAD - 1;
+  return i;
+}
+
+inline int Move::DDANext(int i)
+{
+  i++;
+  if(i >= DDA_RING_LENGTH)
+    i = 0;
+  return i;
+}
+
+inline boolean Move::Idle()
+{
+  return QueueEmpty() && segment >= segments && ddaAddPointer == ddaReadPointer && !stepping && !stoppedDDA;
+}
+
+inline unsigned long Move::MaxStepLatency()
+{
+  return maxStepLatency;
+}
+
+inline boolean Move::EndstopHit()
+{
+  return endstopHit;
+}
+
+inline boolean Move::Simulating()
+{
+  return simulating;
+}
+
+inline unsigned long Move::MovesDone()
+{
+  return movesDone;
+}
+
+inline float Move::MoveTime()
+{
+  return moveTime;
+}
+
+inline int Move::QueuePeak()
+{
+  return queuePeak;
+}
+
+inline void Move::SetFileOffset(unsigned long offset)
+{
+  fileOffset = offset;
+}
+
+inline BedMesh* Move::GetBedMesh()
+{
+  return &bedMesh;
+}
+
+inline void Move::MotorPosition(const Vec<DRIVES>& position, Vec<DRIVES>& motors)
+{
+  if(!bedMesh.Active())
+  {
+    Kinematics::Transform(position, motors);
+    return;
+  }
+  Vec<DRIVES> p = position;
+  p[Z_AXIS] += bedMesh.Height(p[X_AXIS], p[Y_AXIS]);
+  Kinematics::Transform(p, motors);
+}
+
+// One slot is always left empty so that full and empty can be told apart
+
+inline boolean Move::RingFull()
+{
+  return Next(addPointer) == readPointer;
+}
+
+inline boolean Move::QueueFull()
+{
+  return segment < segments || RingFull();
+}
+
+inline boolean Move::QueueEmpty()
+{
+  return addPointer == readPointer;
+}
+
+inline int Move::QueueDepth()
+{
+  int d = addPointer - readPointer;
+  if(d < 0)
+    d += LOOK_AHEAD;
+  return d;
+}
+
 #endif
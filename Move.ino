@@ -22,23 +22,46 @@ Licence: GPL
 
 Move::Move(Platform* p)
 {
-  //Serial.println("Move constructor"); 
+  //Serial.println("Move constructor");
   platform = p;
   active = false;
 }
 
 void Move::Init()
 {
-  lastTime = platform->Time();
   platform->SetDirection(X_AXIS, FORWARDS);
   platform->SetDirection(Y_AXIS, FORWARDS);
   platform->SetDirection(Z_AXIS, FORWARDS);
   platform->SetDirection(3, FORWARDS);
-  active = true;  
+  addPointer = 0;
+  readPointer = 0;
+  for(int i = 0; i < DRIVES; i++)
+  {
+    lastPosition[i] = 0.0;
+    stepPosition[i] = 0;
+  }
+  segments = 0;
+  segment = 0;
+  bedMesh.Init(platform);
+  MotorsToSteps();
+  ddaAddPointer = 0;
+  ddaReadPointer = 0;
+  currentDDA = 0;
+  stepping = false;
+  maxStepLatency = 0;
+  endstopHit = false;
+  stoppedDDA = 0;
+  fileOffset = NO_FILE_OFFSET;
+  simulating = false;
+  added = false;
+  ResetStatistics();
+  active = true;
 }
 
 void Move::Exit()
 {
+  platform->SetInterrupt(-1);
+  stepping = false;
   active = false;
 }
 
@@ -46,15 +69,681 @@ void Move::Spin()
 {
   if(!active)
     return;
-    
-   unsigned long t = platform->Time();
-   if(t - lastTime < 300)
+
+   // Simulated moves are taken when the ring fills, or all at once when nothing more is coming
+
+   if(simulating)
+   {
+     if(segment < segments)
+       QueueSegments();
+     if(!added)
+     {
+       while(NextMove())
+         ;
+     }
+     added = false;
      return;
-   lastTime = t;
-   //Serial.println("tick");
-/*  platform->step(X_AXIS);
-   platform->step(Y_AXIS);
-   platform->step(Z_AXIS);
-   platform->step(3);
-   */
+   }
+
+   if(stoppedDDA && !stepping)
+     EndstopStopped();
+   NextMove();
+   if(segment < segments)
+     QueueSegments();
+
+   // If the interrupt has run out of moves it will have stopped itself
+
+   if(!stepping && ddaAddPointer != ddaReadPointer)
+   {
+     stepping = true;
+     platform->SetInterrupt(DDA_START_INTERVAL);
+   }
+}
+
+// Take the oldest move from the ring and commit it to the step generator.  Its exit speed
+// is now the fixed entry speed of the move behind it (if any); with nothing behind it
+// it must stop.
+
+boolean Move::NextMove()
+{
+  if(QueueEmpty() || DDANext(ddaAddPointer) == ddaReadPointer)
+    return false;
+
+  LookAhead* la = &lookAheadRing[readPointer];
+  readPointer = Next(readPointer);
+  float exitSpeed = 0.0;
+  if(!QueueEmpty())
+    exitSpeed = lookAheadRing[readPointer].EntrySpeed();
+  movesDone++;
+  moveTime += la->Duration(exitSpeed);
+  if(ddaRing[ddaAddPointer].Init(la, exitSpeed, stepPosition, platform) && !simulating)
+    ddaAddPointer = DDANext(ddaAddPointer);
+  return true;
+}
+
+// Called from the step timer interrupt - keep it short.
+
+void Move::Interrupt()
+{
+  unsigned long latency = platform->InterruptLatency();
+  if(latency > maxStepLatency)
+    maxStepLatency = latency;
+
+  if(!currentDDA)
+  {
+    if(ddaReadPointer == ddaAddPointer)
+    {
+      platform->SetInterrupt(-1);
+      stepping = false;
+      return;
+    }
+    currentDDA = &ddaRing[ddaReadPointer];
+  }
+
+  if(!currentDDA->Step())
+  {
+    if(currentDDA->EndstopHit())
+    {
+      endstopHit = true;
+      stoppedDDA = currentDDA;
+    }
+    currentDDA = 0;
+    ddaReadPointer = DDANext(ddaReadPointer);
+  }
+}
+
+boolean Move::AddMove(float to[], float feedRate)
+{
+  if(simulating && RingFull())
+    NextMove();
+  if(QueueFull())
+    return false;
+  if(Kinematics::SegmentLength() <= 0.0 && !bedMesh.Active())
+    return AddLookAhead(to, feedRate, fileOffset);
+
+  segmentStart = Vec<DRIVES>(lastPosition);
+  segmentEnd = Vec<DRIVES>(to);
+  segments = 1;
+  if(Kinematics::SegmentLength() > 0.0)
+  {
+    float d = 0.0;
+    for(int i = 0; i < AXES; i++)
+      d += (segmentEnd[i] - segmentStart[i])*(segmentEnd[i] - segmentStart[i]);
+    segments = (int)ceil(sqrt(d)/Kinematics::SegmentLength());
+    if(segments < 1)
+      segments = 1;
+  }
+  segment = 0;
+  segmentFraction = 0.0;
+  segmentFeedRate = feedRate;
+  segmentOffset = fileOffset;
+  QueueSegments();
+  return true;
+}
+
+// Each piece ends at the next end of a segment or the next edge of a cell of the bed,
+// whichever comes first.
+
+void Move::QueueSegments()
+{
+  float to[DRIVES];
+  float t, edge;
+  Vec<DRIVES> d = segmentEnd - segmentStart;
+  Vec<DRIVES> p;
+  while(segment < segments)
+  {
+    if(RingFull() && !(simulating && NextMove()))
+      return;
+    t = (float)(segment + 1)/(float)segments;
+    edge = bedMesh.Active() ? bedMesh.NextCrossing(segmentStart, segmentEnd, segmentFraction) : 1.0;
+    if(edge < t)
+      t = edge;
+    else
+      segment++;
+    segmentFraction = t;
+    if(segment >= segments)
+      p = segmentEnd;
+    else
+      p = segmentStart + d*t;
+    p.Get(to);
+    AddLookAhead(to, segmentFeedRate, segmentOffset);
+  }
+}
+
+// A homing move has the queue to itself, so it starts and finishes at rest.  Moves are
+// always straight lines for the endstops, however the motors move.
+
+boolean Move::AddHomingMove(float to[], float feedRate, int axis, bool direction)
+{
+  if(!Idle())
+    return false;
+  endstopHit = false;
+  for(int i = 0; i < DRIVES; i++)
+    homingStart[i] = lastPosition[i];
+  if(!AddLookAhead(to, feedRate, fileOffset))
+    return false;
+  if(!QueueEmpty())
+    lookAheadRing[Previous(addPointer)].SetEndstop(axis, direction);
+  return true;
+}
+
+boolean Move::AddLookAhead(float to[], float feedRate, unsigned long offset)
+{
+  if(RingFull())
+    return false;
+
+  Vec<DRIVES> position(to);
+  Vec<DRIVES> motors;
+  MotorPosition(position, motors);
+  LookAhead* la = &lookAheadRing[addPointer];
+  la->Init(lastPosition, to, lastMotorPosition, motors, feedRate, platform);
+  if(la->Distance() <= 0.0)
+    return true;
+  la->SetFileOffset(offset);
+
+  if(QueueEmpty())
+  {
+    la->SetMaxEntrySpeed(0.0);
+    la->SetEntrySpeed(0.0);
+  } else
+    la->SetMaxEntrySpeed(lookAheadRing[Previous(addPointer)].JunctionSpeed(la, platform));
+
+  for(int i = 0; i < DRIVES; i++)
+    lastPosition[i] = to[i];
+  lastMotorPosition = motors;
+  addPointer = Next(addPointer);
+  if(QueueDepth() > queuePeak)
+    queuePeak = QueueDepth();
+  added = true;
+  Recalculate();
+  return true;
+}
+
+// Backward pass: the newest move must be able to stop, and every move must be able
+// to slow down to the entry speed of the one after it.  Forward pass: every move must
+// be able to accelerate to the entry speed of the one after it.  The oldest move's
+// entry speed is already committed, so neither pass changes it.
+
+void Move::Recalculate()
+{
+  if(QueueEmpty())
+    return;
+
+  int newest = Previous(addPointer);
+  int i = newest;
+  float exitSpeed = 0.0;
+  float v;
+  while(i != readPointer)
+  {
+    LookAhead* la = &lookAheadRing[i];
+    v = la->ReachableSpeed(exitSpeed);
+    if(v > la->MaxEntrySpeed())
+      v = la->MaxEntrySpeed();
+    la->SetEntrySpeed(v);
+    exitSpeed = v;
+    i = Previous(i);
+  }
+
+  i = readPointer;
+  while(i != newest)
+  {
+    int n = Next(i);
+    v = lookAheadRing[i].ReachableSpeed(lookAheadRing[i].EntrySpeed());
+    if(v < lookAheadRing[n].EntrySpeed())
+      lookAheadRing[n].SetEntrySpeed(v);
+    i = n;
+  }
+}
+
+// The step interrupt may finish the oldest move while this looks at it, but then the one
+// found is at worst a move out of date.
+
+unsigned long Move::FileOffset()
+{
+  int i = ddaReadPointer;
+  if(i != ddaAddPointer)
+    return ddaRing[i].FileOffset();
+  if(!QueueEmpty())
+    return lookAheadRing[readPointer].FileOffset();
+  if(segment < segments)
+    return segmentOffset;
+  return NO_FILE_OFFSET;
+}
+
+void Move::GetLastPosition(float m[])
+{
+  if(segment < segments)
+  {
+    segmentEnd.Get(m);
+    return;
+  }
+  for(int i = 0; i < DRIVES; i++)
+    m[i] = lastPosition[i];
+}
+
+void Move::SetLastPosition(float m[])
+{
+  Vec<DRIVES> position(m);
+  Vec<DRIVES> motors;
+  MotorPosition(position, motors);
+  for(int i = 0; i < DRIVES; i++)
+  {
+    lastPosition[i] = m[i];
+    stepPosition[i] = (long)floor(motors[i]*platform->DriveStepsPerUnit(i) + 0.5);
+  }
+  lastMotorPosition = motors;
+}
+
+void Move::MotorsToSteps()
+{
+  for(int i = 0; i < DRIVES; i++)
+    lastMotorPosition[i] = (float)stepPosition[i]/platform->DriveStepsPerUnit(i);
+}
+
+// A homing move is straight for the motors as well as in space, so it stopped as far along
+// in one as in the other.
+
+void Move::EndstopStopped()
+{
+  float f = stoppedDDA->Unstep(stepPosition);
+  stoppedDDA = 0;
+  for(int i = 0; i < DRIVES; i++)
+    lastPosition[i] = homingStart[i] + (lastPosition[i] - homingStart[i])*f;
+  MotorsToSteps();
+}
+
+// The nozzle stays where it is, so its position in Z changes by the change in the bed under it;
+// the next move takes it to where it should be.
+
+void Move::SetBedMesh(float heights[])
+{
+  bedMesh.Set(heights);
+  MotorsToSteps();
+}
+
+void Move::ClearBedMesh()
+{
+  bedMesh.Clear();
+  MotorsToSteps();
+}
+
+// Simulated moves leave the positions where the print would have finished, so put them back
+// to where the machine really is.
+
+void Move::Simulate(boolean on)
+{
+  if(on == simulating)
+    return;
+  if(on)
+    GetLastPosition(savedPosition);
+  else
+    SetLastPosition(savedPosition);
+  simulating = on;
+}
+
+void Move::ResetStatistics()
+{
+  movesDone = 0;
+  moveTime = 0.0;
+  queuePeak = 0;
+}
+
+//****************************************************************************************************
+
+LookAhead::LookAhead()
+{
+  distance = 0.0;
+  entrySpeed = 0.0;
+  maxEntrySpeed = 0.0;
+}
+
+// Work out the move's length, how far each motor goes for each mm of it, and hence the fastest
+// feedrate and acceleration that none of the motors will exceed.  The length is in X, Y and Z,
+// which is what F is the speed along; only a move of the extruders alone is measured along them.
+
+void LookAhead::Init(float from[], float to[], Vec<DRIVES>& motorFrom, Vec<DRIVES>& motorTo, float f, Platform* p)
+{
+  endstopAxis = -1;
+  Vec<DRIVES> start(from);
+  endPoint = Vec<DRIVES>(to);
+  Vec<DRIVES> d = endPoint - start;
+  float d2 = 0.0;
+  int i;
+  for(i = 0; i < AXES; i++)
+    d2 += d[i]*d[i];
+  if(d2 <= 0.0)
+  {
+    for(i = AXES; i < DRIVES; i++)
+      d2 += d[i]*d[i];
+  }
+  distance = sqrt(d2);
+  if(distance <= 0.0)
+    return;
+
+  motorEndPoint = motorTo;
+  unit = (motorEndPoint - motorFrom)/distance;
+
+  feedRate = f;
+  acceleration = -1.0;
+  float u, limit;
+  for(i = 0; i < DRIVES; i++)
+  {
+    u = fabs(unit[i]);
+    if(u <= 0.0)
+      continue;
+    limit = p->MaxFeedrate(i)/u;
+    if(limit < feedRate)
+      feedRate = limit;
+    limit = p->Acceleration(i)/u;
+    if(acceleration < 0.0 || limit < acceleration)
+      acceleration = limit;
+  }
+  entrySpeed = 0.0;
+  maxEntrySpeed = 0.0;
+}
+
+// The speed at the join with the next move is limited by both feedrates, and by
+// the change of speed that it causes in each drive, which must not exceed the jerk.
+
+float LookAhead::JunctionSpeed(LookAhead* next, Platform* p)
+{
+  float v = feedRate;
+  if(next->feedRate < v)
+    v = next->feedRate;
+  float du;
+  for(int i = 0; i < DRIVES; i++)
+  {
+    du = fabs(next->unit[i] - unit[i]);
+    if(du*v > p->Jerk(i))
+      v = p->Jerk(i)/du;
+  }
+  return v;
+}
+
+// Accelerate from the entry speed, cruise, and decelerate to the exit speed.  If
+// there isn't room to reach the feedrate the top speed is where the two ramps meet.
+
+void LookAhead::Trapezoid(float exitSpeed, float& accelDistance, float& decelDistance, float& topSpeed)
+{
+  float twoA = 2.0*acceleration;
+  float v02 = entrySpeed*entrySpeed;
+  float v12 = exitSpeed*exitSpeed;
+  topSpeed = feedRate;
+  accelDistance = (topSpeed*topSpeed - v02)/twoA;
+  decelDistance = (topSpeed*topSpeed - v12)/twoA;
+  if(accelDistance + decelDistance <= distance)
+    return;
+
+  float top2 = acceleration*distance + 0.5*(v02 + v12);
+  topSpeed = sqrt(top2);
+  accelDistance = (top2 - v02)/twoA;
+  if(accelDistance < 0.0)
+    accelDistance = 0.0;
+  if(accelDistance > distance)
+    accelDistance = distance;
+  decelDistance = distance - accelDistance;
+}
+
+float LookAhead::Duration(float exitSpeed)
+{
+  float accelDistance, decelDistance, topSpeed;
+  Trapezoid(exitSpeed, accelDistance, decelDistance, topSpeed);
+  if(topSpeed <= 0.0)
+    return 0.0;
+  return (topSpeed - entrySpeed)/acceleration + (topSpeed - exitSpeed)/acceleration +
+    (distance - accelDistance - decelDistance)/topSpeed;
+}
+
+//****************************************************************************************************
+
+DDA::DDA()
+{
+  totalSteps = 0;
+}
+
+// Work out the steps for each drive from the move's end point, so rounding errors
+// never accumulate, and convert the velocity profile into steps along the drive that
+// moves furthest.
+
+boolean DDA::Init(LookAhead* la, float exitSpeed, long position[], Platform* p)
+{
+  int i;
+  long target;
+  platform = p;
+  endstopAxis = la->EndstopAxis();
+  endstopDirection = la->EndstopDirection();
+  endstopHit = false;
+  fileOffset = la->FileOffset();
+  totalSteps = 0;
+  for(i = 0; i < DRIVES; i++)
+  {
+    target = (long)floor(la->MotorEndPoint()[i]*platform->DriveStepsPerUnit(i) + 0.5);
+    delta[i] = target - position[i];
+    position[i] = target;
+    directions[i] = FORWARDS;
+    if(delta[i] < 0)
+    {
+      delta[i] = -delta[i];
+      directions[i] = BACKWARDS;
+    }
+    if(delta[i] > totalSteps)
+      totalSteps = delta[i];
+  }
+  if(totalSteps <= 0)
+    return false;
+
+  for(i = 0; i < DRIVES; i++)
+    counter[i] = -totalSteps/2;
+  stepCount = 0;
+
+  float accelDistance, decelDistance, topSpeed;
+  la->Trapezoid(exitSpeed, accelDistance, decelDistance, topSpeed);
+  float k = (float)totalSteps/la->Distance(); // Steps per mm along the move
+  float a = la->Acceleration()*k;
+  float v = la->EntrySpeed()*k;
+  topSpeed *= k;
+
+  accelStopStep = (long)(accelDistance*k + 0.5);
+  decelStartStep = totalSteps - (long)(decelDistance*k + 0.5);
+  if(decelStartStep < accelStopStep)
+    decelStartStep = accelStopStep;
+
+  // Starting from rest Austin's first interval needs his 0.676 correction
+
+  rampIndex = (long)(v*v/(2.0*a) + 0.5);
+  float c;
+  if(rampIndex < 1)
+  {
+    rampIndex = 0;
+    c = 0.676*STEP_CLOCK_RATE*sqrt(2.0/a);
+  } else
+    c = STEP_CLOCK_RATE/v;
+  if(c > MAX_STEP_INTERVAL)
+    c = MAX_STEP_INTERVAL;
+  interval = (unsigned long)c;
+
+  decelRampIndex = (long)(topSpeed*topSpeed/(2.0*a) + 0.5);
+  if(decelRampIndex < 1)
+    decelRampIndex = 1;
+  c = STEP_CLOCK_RATE/topSpeed;
+  if(c > MAX_STEP_INTERVAL)
+    c = MAX_STEP_INTERVAL;
+  topInterval = (unsigned long)c;
+  if(topInterval < MIN_STEP_INTERVAL)
+    topInterval = MIN_STEP_INTERVAL;
+
+  return true;
+}
+
+// Called from the step timer interrupt - integers only in here.  A homing move looks at
+// its endstop before every step, and finishes without making the step once it's hit.
+
+boolean DDA::Step()
+{
+  int i;
+  if(!stepCount)
+  {
+    for(i = 0; i < DRIVES; i++)
+      platform->SetDirection(i, directions[i]);
+  }
+
+  if(endstopAxis >= 0 && platform->Stopped(endstopAxis, endstopDirection))
+  {
+    endstopHit = true;
+    platform->NextInterrupt(MIN_STEP_INTERVAL);
+    return false;
+  }
+
+  byte drivesToStep = 0;
+  for(i = 0; i < DRIVES; i++)
+  {
+    counter[i] += delta[i];
+    if(counter[i] > 0)
+    {
+      drivesToStep |= 1 << i;
+      counter[i] -= totalSteps;
+    }
+  }
+  platform->StepDrives(drivesToStep);
+  stepCount++;
+
+  if(stepCount < accelStopStep)
+  {
+    rampIndex++;
+    interval -= (interval << 1)/((rampIndex << 2) + 1);
+    if(interval < topInterval)
+      interval = topInterval;
+  } else if(stepCount >= decelStartStep)
+  {
+    if(stepCount == decelStartStep)
+      rampIndex = decelRampIndex;
+    interval += (interval << 1)/((rampIndex << 2) - 1);
+    if(rampIndex > 1)
+      rampIndex--;
+    if(interval > MAX_STEP_INTERVAL)
+      interval = MAX_STEP_INTERVAL;
+  } else
+    interval = topInterval;
+
+  platform->NextInterrupt(interval);
+  return stepCount < totalSteps;
+}
+
+// Each drive's Bresenham counter started at -totalSteps/2 and has had delta added at every
+// step and totalSteps taken off at each of its own steps, so it says how many it has made.
+
+float DDA::Unstep(long position[])
+{
+  long made;
+  for(int i = 0; i < DRIVES; i++)
+  {
+    made = (long)(((long long)stepCount*delta[i] - totalSteps/2 - counter[i])/totalSteps);
+    if(directions[i] == FORWARDS)
+      position[i] -= delta[i] - made;
+    else
+      position[i] += delta[i] - made;
+  }
+  return (float)stepCount/(float)totalSteps;
+}
+
+//****************************************************************************************************
+
+BedMesh::BedMesh()
+{
+  active = false;
+}
+
+void BedMesh::Init(Platform* p)
+{
+  x0 = BED_PROBE_MARGIN;
+  y0 = BED_PROBE_MARGIN;
+  xStep = (p->AxisLength(X_AXIS) - 2.0*BED_PROBE_MARGIN)/(BED_GRID - 1);
+  yStep = (p->AxisLength(Y_AXIS) - 2.0*BED_PROBE_MARGIN)/(BED_GRID - 1);
+  xScale = 1.0/xStep;
+  yScale = 1.0/yStep;
+  active = false;
+}
+
+void BedMesh::ProbePoint(int point, float& x, float& y)
+{
+  x = x0 + (point%BED_GRID)*xStep;
+  y = y0 + (point/BED_GRID)*yStep;
+}
+
+// Expand z00 + (z10 - z00)u + (z01 - z00)v + (z11 - z10 - z01 + z00)uv, where u and v go from
+// 0 to 1 across the cell from its corner (xc, yc), into powers of x and y.
+
+void BedMesh::Set(float heights[])
+{
+  float z00, z10, z01, z11, dzdx, dzdy, xc, yc;
+  for(int j = 0; j < BED_GRID - 1; j++)
+  {
+    for(int i = 0; i < BED_GRID - 1; i++)
+    {
+      z00 = heights[j*BED_GRID + i];
+      z10 = heights[j*BED_GRID + i + 1];
+      z01 = heights[(j + 1)*BED_GRID + i];
+      z11 = heights[(j + 1)*BED_GRID + i + 1];
+      xc = x0 + i*xStep;
+      yc = y0 + j*yStep;
+      dzdx = (z10 - z00)*xScale;
+      dzdy = (z01 - z00)*yScale;
+      float* c = cells[j][i];
+      c[3] = (z11 - z10 - z01 + z00)*xScale*yScale;
+      c[2] = dzdy - c[3]*xc;
+      c[1] = dzdx - c[3]*yc;
+      c[0] = z00 - dzdx*xc - dzdy*yc + c[3]*xc*yc;
+    }
+  }
+  active = true;
+}
+
+void BedMesh::Clear()
+{
+  active = false;
+}
+
+float BedMesh::NextCrossing(const Vec<DRIVES>& from, const Vec<DRIVES>& to, float t)
+{
+  float next = 1.0;
+  Crossing(from[X_AXIS], to[X_AXIS], x0, xStep, t, next);
+  Crossing(from[Y_AXIS], to[Y_AXIS], y0, yStep, t, next);
+  return next;
+}
+
+// Where a line from a to b next crosses one of the lines between the cells after t.  The
+// outermost lines of probe points aren't between cells, as the edge cells carry on past them.
+
+void BedMesh::Crossing(float a, float b, float origin, float step, float t, float& next)
+{
+  float d = b - a;
+  if(d == 0.0)
+    return;
+  float cell = (a + d*t - origin)/step;
+  int k, dk;
+  if(d > 0.0)
+  {
+    k = (int)floor(cell) + 1;
+    if(k < 1)
+      k = 1;
+    dk = 1;
+  } else
+  {
+    k = (int)ceil(cell) - 1;
+    if(k > BED_GRID - 2)
+      k = BED_GRID - 2;
+    dk = -1;
+  }
+  float c;
+  while(k >= 1 && k <= BED_GRID - 2)
+  {
+    c = (origin + k*step - a)/d;
+    if(c > t)
+    {
+      if(c < next)
+        next = c;
+      return;
+    }
+    k += dk; // Rounding put t just past it
+  }
 }
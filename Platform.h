@@ -64,12 +64,14 @@ Licence: GPL
 #define ENABLE_PINS {38, -1, 62, -1}
 #define ENABLE 0      // What to send to enable... 
 #define DISABLE 1     // ...and disable a drive
+#define STEP_PULSE_LENGTH 1 // Microseconds the step pins are held high
 #define DISABLE_DRIVES {false, false, true, false} // Set true to disable a drive when it becomes idle
 #define MAX_FEEDRATES {300, 300, 3, 45}    // mm/sec   
 #define MAX_ACCELERATIONS {800, 800, 30, 250}    // mm/sec^2?? Maximum start speed for accelerated moves.
 #define DRIVE_STEPS_PER_UNIT {91.4286, 91.4286, 4000, 929}
 #define JERKS {15.0, 15.0, 0.4, 15.0}    // (mm/sec)
 #define DRIVE_RELATIVE_MODES {false, false, false, true} // false for default absolute movement, true for relative to last position
+#define GCODE_LETTERS {'X', 'Y', 'Z', 'E'} // The letters that G Codes use for each drive
 
 // AXES
 
@@ -78,11 +80,22 @@ Licence: GPL
 #define ENDSTOP_HIT 1 // when a stop == this it is hit
 #define AXIS_LENGTHS {210, 210, 120} // mm
 #define FAST_HOME_FEEDRATES {50*60, 50*60, 1*60}  // mm/min
+#define HOME_BACK_OFF 3.0 // mm to back off an endstop after finding it, before finding it again...
+#define SLOW_HOME_FRACTION 0.1 // ...at this fraction of the fast homing feedrate
+#define BED_PROBE_MARGIN 10.0 // mm in from the ends of X and Y to the outermost points probed on the bed
+#define BED_PROBE_HEIGHT 5.0 // Z (mm) to go between the points at; the probe looks as far below Z = 0 as this is above
 
 #define X_AXIS 0  // The index of the X axis
 #define Y_AXIS 1  // The index of the Y axis
 #define Z_AXIS 2  // The index of the Z axis
 
+// How the axis drives move the head - Cartesian, CoreXY or LinearDelta (see Kinematics.h)
+
+#define KINEMATICS Cartesian
+#define DELTA_DIAGONAL_ROD 250.0 // mm - the length of a delta's rods...
+#define DELTA_RADIUS 124.0 // mm - ...the distance of its towers from the centre...
+#define DELTA_SEGMENT_LENGTH 1.0 // mm - ...and the longest straight piece it moves in
+
 // HEATERS - Bed is assumed to be the first
 
 #define TEMP_SENSE_PINS {10, 9}  // Analogue pin numbers
@@ -95,26 +108,63 @@ Licence: GPL
 #define PID_KDS {-1, 100}
 #define PID_KPS {-1, 100}
 #define PID_I_LIMITS {-1, 100} // ... to here
+#define PID_MAX 255.0 // PID output that means full power; the constants above are scaled to this
 #define TEMP_INTERVAL 0.5 // secs - check and control temperatures this often
+#define TEMP_HYSTERESIS 1.0 // Bang-bang heaters switch on this far below the target and off this far above it
 
 #define AD_RANGE 1023.0//16383 // The A->D converter that measures temperatures gives an int this big as its max value
+#define TEMP_SAMPLE_INTERVAL 1000 // Microseconds between background A->D readings of each heater's thermistor
+#define TEMP_OVERSAMPLE_SHIFT 4 // Each sample is the sum of 2^this readings...
+#define TEMP_FILTER_SHIFT 2 // ...and each new one moves the filtered value 1/2^this of the way to it
+#define TEMP_TABLE_SHIFT 6 // Temperature table entries are 2^this sample units (4 A->D counts) apart...
+#define TEMP_TABLE_LENGTH 257 // ...so this many cover the A->D range
+#define TEMP_FRACTION 256.0 // Table temperatures are in 1/this degrees
 
 #define HOT_BED 0 // The index of the heated bed; set to -1 if there is no heated bed
 
 /****************************************************************************************************/
 
+// Step timer - timer counter TC1 channel 0 (TC3 in the Due's numbering) clocked at MCK/2
+
+#define STEP_TIMER TC1
+#define STEP_TIMER_CHANNEL 0
+#define STEP_TIMER_IRQ TC3_IRQn
+#define STEP_CLOCK_RATE 42000000 // Step timer ticks per second
+#define CYCLES_PER_MICROSECOND 84 // Processor clock cycles, counted by Cycles()
+#define STEP_CLOCK_MICROSECOND 42 // Step timer ticks per microsecond
+#define MIN_STEP_INTERVAL 200 // Step timer ticks - never ask for the next step interrupt sooner than this...
+#define MAX_STEP_INTERVAL 0x3FFFFFFF // ...or later than this, so the step arithmetic can't overflow
+#define STEP_TIMER_MARGIN 42 // Step timer ticks - the soonest after the counter's present value that the next interrupt can be set for
+
+/****************************************************************************************************/
+
 // File handling
 
 #define MAX_FILES 7
-#define FILE_BUF_LEN 256
+#define SD_BLOCK_LENGTH 512 // Bytes in an SD card sector - the most efficient size to read and write
+#define FILE_BUF_LEN SD_BLOCK_LENGTH // Files are written a whole sector at a time
+#define CACHE_BLOCKS 8 // Sectors of recently-read files kept in RAM, shared by all the open files
+#define CACHE_NAME_LENGTH 64 // Longest file name (with its directory) whose sectors are shared with other opens of it
+#define FILE_CHANGE_SLOTS 16 // Counts of changes to files, shared out by file name
 #define SD_SPI 4 //Pin
 #define WEB_DIR "www/" // Place to find web files on the server
 #define GCODE_DIR "gcodes/" // Ditto - g-codes
 #define SYS_DIR "sys/" // Ditto - system files
 #define TEMP_DIR "tmp/" // Ditto - temporary files
+#define SIDECAR_DIR "sidecar" // In the system directory - the index of each G Code file, under the same name
 #define FILE_LIST_SEPARATOR ','
 #define FILE_LIST_BRACKET '"'
 #define FILE_LIST_LENGTH 1000 // Maximum lenght of file list
+#define GCODE_INDEX_LENGTH 64 // Most files in the G Code directory that are kept track of
+#define INDEX_NAME_LENGTH 13 // 8.3 file names and a terminator
+#define GCODE_LIST_PAGE 32 // Files listed at a time
+#define SORT_BY_NAME 0
+#define SORT_BY_AGE 1 // Newest first
+#define SORT_BY_SIZE 2 // Largest first
+#define GCODE_ORDERS 3
+#define CONFIG_FILE "config.bin" // The settings image in the system directory
+#define CONFIG_MAGIC 0x52525046 // "RRPF"
+#define CONFIG_VERSION 1 // Change this whenever MachineConfig changes
 
 /****************************************************************************************************/
 
@@ -122,7 +172,7 @@ Licence: GPL
 
 // Enter a MAC address and IP address for your controller below.
 // The IP address will be dependent on your local network:
-#define MAC { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
+#define MAC { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED }
 #define MAC_BYTES 6
 
 #define IP0 192
@@ -136,6 +186,10 @@ Licence: GPL
   
 #define HTTP_PORT 80
 
+#define HTTP_CONNECTIONS 3 // Clients served at once - the W5100 has four sockets, and one is kept listening
+#define CLIENT_CHUNK 1460 // Bytes sent to the client in one write - a full TCP segment on Ethernet
+#define CHUNK_HEADER 6 // Room in front of the bytes to be sent for an HTTP chunk size
+
 // Connection statuses - ORed
 
 #define CLIENT 1
@@ -158,6 +212,57 @@ Licence: GPL
 
 class RepRap;
 
+// The settings that can be changed without rebuilding the firmware.  They are saved in
+// CONFIG_FILE in the system directory as an image of this structure, so loading them at a
+// restart is one read from the card and a CRC check.  An image with the wrong magic number,
+// version or length, or a bad CRC, is ignored and the defaults above are used instead.
+
+struct MachineConfig
+{
+  unsigned long magic;
+  unsigned long version;
+  unsigned long length; // sizeof(MachineConfig)
+
+// DRIVES
+
+  signed char stepPins[DRIVES];
+  signed char directionPins[DRIVES];
+  signed char enablePins[DRIVES];
+  boolean disableDrives[DRIVES];
+  float maxFeedrates[DRIVES];  
+  float maxAccelerations[DRIVES];
+  float driveStepsPerUnit[DRIVES];
+  float jerks[DRIVES];
+  boolean driveRelativeModes[DRIVES];
+
+// AXES
+
+  signed char lowStopPins[AXES];
+  signed char highStopPins[AXES];
+  float axisLengths[AXES];
+  float fastHomeFeedrates[AXES];
+
+// HEATERS - Bed is assumed to be the first
+
+  signed char tempSensePins[HEATERS];
+  signed char heatOnPins[HEATERS];
+  float thermistorBetas[HEATERS];
+  float thermistorSeriesRs[HEATERS];
+  float thermistor25Rs[HEATERS];
+  boolean usePid[HEATERS];
+  float pidKis[HEATERS];
+  float pidKds[HEATERS];
+  float pidKps[HEATERS];
+  float pidILimits[HEATERS];
+
+// Network
+
+  byte mac[MAC_BYTES];
+  byte ip[4];
+
+  unsigned long crc; // CRC-32 of everything above - must be last
+};
+
 class Platform
 {   
   public:
@@ -180,51 +285,108 @@ class Platform
   // Timing
   
   unsigned long Time(); // Returns elapsed microseconds since some arbitrary time
+  unsigned long Cycles(); // Processor clock cycles since some arbitrary time; wraps round every 51 seconds
   
   void SetInterrupt(long t); // Set a regular interrupt going every t microseconds; if t is -ve turn interrupt off
   
   void Interrupt(); // The function that the interrupt calls
+
+  void NextInterrupt(unsigned long ticks); // Call from inside Interrupt(): the next one comes this many step clock ticks after this one should have (or as soon as possible if that has passed)
+  
+  unsigned long InterruptLatency(); // Call from inside Interrupt(): step clock ticks since it should have happened
   
   // Communications and data storage; opening something unsupported returns -1.
   
   char* FileList(char* directory); // Returns a ;-separated list of all the files in the named directory (for example on an SD card).
+  void IndexGCode(char* fileName, unsigned long length); // Add a file to the index of the G Code directory, or update it
+  void UnindexGCode(char* fileName); // Take one out
+  int GCodeCount(); // Files in the index
+  char* GCodeList(int order, int page); // A page of the index as a list like FileList()'s...
+  char* GCodeLengths(int order, int page); // ...and the lengths of the same files
   int OpenFile(char* fileName, boolean write); // Open a local file (for example on an SD card).
   void GoToEnd(int file); // Position the file at the end (so you can write on the end).
+  boolean Seek(int file, unsigned long position); // Position the file position bytes from the start
+  unsigned long Length(int file); // Bytes in the file
   boolean Read(int file, unsigned char& b);     // Read a single byte from a file into b, 
                                              // returned value is false for EoF, true otherwise
+  int Read(int file, char* b, int length); // Read up to length bytes into b; returns the number read, 0 at EoF
   void WriteString(int file, char* s);  // Write the string to a file.
   void Write(int file, char b);  // Write the byte b to a file.
+  void Write(int file, char* b, int length); // Write length bytes from b to a file.
   char* GetWebDir(); // Where the php/htm etc files are
   char* GetGcodeDir(); // Where the gcodes are
   char* GetSysDir();  // Where the system files are
   char* GetTempDir(); // Where temporary files are
   void Close(int file); // Close a file or device, writing any unwritten buffer contents first.
   boolean DeleteFile(char* fileName); // Delete a file
+  unsigned long FileChanges(char* fileName); // Goes up whenever the file is written or deleted (and sometimes when it isn't)
+  unsigned long NameHash(char* fileName); // Case-insensitive FNV-1a hash of a name; never 0
   char* PrependRoot(char* root, char* fileName);
   
+  void SelectClient(int c); // The connection that the client functions below act on
   unsigned char ClientRead(); // Read a byte from the client
+  int ClientRead(char* b, int length); // Read up to length bytes from the client; returns the number read
   void SendToClient(char* message); // Send string to the host
   void SendToClient(unsigned char b); // Send byte to the host
+  void SendToClient(char* b, int length); // Send length bytes to the host
+  void ChunkClientOutput(); // Send what follows as HTTP chunks, up to EndClientOutput()
+  void FlushClient(); // Send anything still waiting to go to the host
+  void EndClientOutput(); // Flush, and end the chunks if the output is chunked
   int ClientStatus(); // Check client's status
   void DisconnectClient(); //Disconnect the client  
   
+  boolean SerialAvailable(); // Has anything come in on the USB serial line?
+  unsigned char SerialRead(); // Read a byte from it
+
+  float CacheHitRate(); // Fraction of file sectors read that were found in RAM
+  unsigned long FileBytesPerSecond(); // Bytes read from files over the last few seconds
+
   void Message(char type, char* message);        // Send a message.  Messages may simply flash an LED, or, 
                             // say, display the messages on an LCD. This may also transmit the messages to the host. 
+  void Message(char type, char* message, byte severity); // The same, with a severity for the log
+  void SendLogToClient(); // Send the most recent messages from RAM
+  int LogTail(char* b, int length); // Copy the latest whole messages that fit in length bytes to b; returns the bytes copied
+  unsigned long MessagesDropped(); // Messages lost because the log was full
+  unsigned long LastFlushTime(); // Microseconds taken to write the log to the file last time...
+  unsigned long MaxFlushTime(); // ...and the longest ever
   
   // Movement
   
   void SetDirection(byte drive, bool direction);
   void Step(byte drive);
+  void StepDrives(byte drives); // Step every drive whose bit is set in drives all at once
   void Disable(byte drive); // There is no drive enable; drives get enabled automatically the first time they are used.
-  void Home(byte axis);
-  
-  float ZProbe();  // Return the height above the bed.  Returned value is negative if probing isn't implemented
-  void ZProbe(float h); // Move to height h above the bed using the probe (if there is one).  h should be non-negative.
+  boolean Stopped(byte axis, bool direction); // Is the endstop at that end of the axis hit?  Fast enough for the step interrupt.
+  int HomingDirection(byte axis); // The end with an endstop (the low one if both), or -1 if there isn't one
+  float HomeFeedrate(byte axis); // mm/sec
+  float AxisLength(byte axis); // mm
+  float DriveStepsPerUnit(byte drive);
+  float MaxFeedrate(byte drive); // mm/sec
+  float Acceleration(byte drive); // mm/sec^2
+  float Jerk(byte drive); // mm/sec - the largest instantaneous speed change the drive can take
+  boolean DriveRelativeMode(byte drive); // Does a G Code give this drive's position relative to the last one by default?
+
+  boolean ZProbe(); // Is the Z probe triggered?  The probe is the endstop at the low end of Z, which must be on the head.
   
   // Heat and temperature
   
   float GetTemperature(byte heater); // Result is in degrees celsius
   void SetHeater(byte heater, const float& power); // power is a fraction in [0,1]
+  boolean UsePID(byte heater); // PID or bang-bang?
+  float PidKp(byte heater); // PID_MAX per degree
+  float PidKi(byte heater); // PID_MAX per degree second
+  float PidKd(byte heater); // PID_MAX seconds per degree
+  float PidILimit(byte heater); // The largest the integral term may get
+  void SetPid(byte heater, float kp, float ki, float kd); // New constants from M301 or an autotune
+  
+  // Settings
+  
+  void SetDriveStepsPerUnit(byte drive, float value);
+  void SetMaxFeedrate(byte drive, float value);
+  void SetAcceleration(byte drive, float value);
+  boolean SaveToStore(); // Write the settings as they are now to CONFIG_FILE, to be used at the next restart
+  boolean ReloadFromStore(); // Go back to the saved settings, or to the defaults if there aren't any
+  unsigned long ConfigLoadTime(); // Microseconds taken to load the settings at the last restart
 
 //-------------------------------------------------------------------------------------------------------
   
@@ -237,42 +399,44 @@ class Platform
   // Load settings from local storage
   
   bool LoadFromStore();
+  unsigned long ConfigCRC();
   
   int GetRawTemperature(byte heater);
+  float ThermistorTemperature(byte heater, float r); // The exact beta equation - used to build the tables
+  void SampleTemperatures();
   
   RepRap* reprap;
   
-// DRIVES
+// The settings, and the wait for them to load from the SD card at the last restart
 
-  char stepPins[DRIVES];
-  char directionPins[DRIVES];
-  char enablePins[DRIVES];
-  boolean disableDrives[DRIVES];
-  float maxFeedrates[DRIVES];  
-  float maxAccelerations[DRIVES];
-  float driveStepsPerUnit[DRIVES];
-  float jerks[DRIVES];
-  boolean driveRelativeModes[DRIVES];
+  MachineConfig config;
+  unsigned long configLoadTime;
 
-// AXES
+// The pins in config as Due I/O ports and bit masks, so the step interrupt can drive them directly.
+// Drives whose step pins share a port are stepped with one write.
 
-  char lowStopPins[AXES];
-  char highStopPins[AXES];
-  float axisLengths[AXES];
-  float fastHomeFeedrates[AXES];
+  void InitialisePorts();
+  
+  Pio* stepPorts[DRIVES];
+  uint32_t stepMasks[DRIVES];
+  Pio* directionPorts[DRIVES];
+  uint32_t directionMasks[DRIVES];
+  Pio* enablePorts[DRIVES];
+  uint32_t enableMasks[DRIVES];
+  boolean driveEnabled[DRIVES];
+  Pio* stepPortList[DRIVES];
+  byte stepPortIndex[DRIVES];
+  byte stepPortCount;
+  Pio* stopPorts[AXES][2]; // Indexed by the direction of the end - BACKWARDS (low) or FORWARDS (high)
+  uint32_t stopMasks[AXES][2];
 
 // HEATERS - Bed is assumed to be the first
 
-  char tempSensePins[HEATERS];
-  char heatOnPins[HEATERS];
-  float thermistorBetas[HEATERS];
-  float thermistorSeriesRs[HEATERS];
-  float thermistorInfRs[HEATERS];
-  boolean usePid[HEATERS];
-  float pidKis[HEATERS];
-  float pidKds[HEATERS];
-  float pidKps[HEATERS];
-  float pidILimits[HEATERS];
+  float thermistorInfRs[HEATERS]; // Worked out from config.thermistor25Rs
+  long temperatureTable[HEATERS][TEMP_TABLE_LENGTH]; // Degrees/TEMP_FRACTION against filtered A->D sample
+  long adcSum[HEATERS];
+  long adcFiltered[HEATERS];
+  int adcCount;
 
 // Files
 
@@ -284,17 +448,83 @@ class Platform
   char* tempDir;
   byte* buf[MAX_FILES];
   int bPointer[MAX_FILES];
+  boolean writing[MAX_FILES];
+  
+// Reading is done a sector at a time through a cache shared by all the files.  A file open
+// for reading keeps its position and the cache slot holding the sector that position is in;
+// if that slot has since been taken for something else the sector is looked up (or read) again.
+// Slots are found by name hash, but the name itself must match too, as different names can
+// have the same hash.  A name too long to keep is matched on the file that read the slot in.
+
+  int CacheSlot(int file); // The slot holding the sector at the file's position, or -1
+  boolean CachedFrom(int slot, int file); // Does the slot hold a sector of this file?
+  void Uncache(unsigned long hash); // Forget any sectors of the file with this name
+
+  unsigned long fileHash[MAX_FILES];
+  char fileName[MAX_FILES][CACHE_NAME_LENGTH]; // Empty if the name is too long to keep
+  unsigned long filePosition[MAX_FILES];
+  unsigned long fileLength[MAX_FILES];
+  int fileSlot[MAX_FILES];
+  byte cache[CACHE_BLOCKS][SD_BLOCK_LENGTH];
+  unsigned long cacheHash[CACHE_BLOCKS]; // 0 for an empty slot
+  char cacheName[CACHE_BLOCKS][CACHE_NAME_LENGTH];
+  int cacheFile[CACHE_BLOCKS];
+  unsigned long cacheBlock[CACHE_BLOCKS];
+  int cacheLength[CACHE_BLOCKS];
+  unsigned long cacheUsed[CACHE_BLOCKS]; // When the slot was last read from, for least-recently-used replacement
+  unsigned long cacheClock;
+  unsigned long changeCounts[FILE_CHANGE_SLOTS];
+  unsigned long cacheHits;
+  unsigned long cacheMisses;
+  unsigned long bytesRead;
+  unsigned long lastBytesRead;
+  unsigned long bytesPerSecond;
   char fileList[FILE_LIST_LENGTH];
+  
+// The index of the G Code directory.  The entries are in no particular order; the lists of
+// them in each order are remade whenever they change.
+  
+  void IndexGCodes();
+  int FindGCode(char* fileName);
+  void SortGCodes();
+  boolean GCodeBefore(int order, int a, int b);
+  
+  char gcodeNames[GCODE_INDEX_LENGTH][INDEX_NAME_LENGTH];
+  unsigned long gcodeLengths[GCODE_INDEX_LENGTH];
+  unsigned long gcodeAges[GCODE_INDEX_LENGTH]; // Bigger is newer: first in directory order, then in order of upload
+  unsigned long gcodeClock;
+  int gcodeCount;
+  byte gcodeOrders[GCODE_ORDERS][GCODE_INDEX_LENGTH];
   char scratchString[STRING_LENGTH];
+
+// Message log - a ring in RAM.  The counts of bytes logged and written to the file only
+// ever go up; their difference is what is waiting to be written.
+
+  void FlushLog();
+  void Log(char* s, int length);
+
+  char logRing[LOG_LENGTH];
+  unsigned long logged;
+  unsigned long logFlushed;
+  unsigned long lastMessageTime;
+  unsigned long messagesDropped;
+  unsigned long lastFlushTime;
+  unsigned long maxFlushTime;
+  unsigned long logFailTime;
+  boolean logFileFailed; // The message file couldn't be opened last time
+  boolean logLineStart;
   
 // Network connection
 
   void ClientMonitor();
   
-  byte mac[MAC_BYTES];
   EthernetServer* server;
-  EthernetClient client;
-  int clientStatus;
+  EthernetClient clients[HTTP_CONNECTIONS];
+  int clientStatus[HTTP_CONNECTIONS];
+  int client; // The selected connection
+  byte clientBuffer[HTTP_CONNECTIONS][CHUNK_HEADER + CLIENT_CHUNK + 2]; // Output is collected here and sent a segment at a time
+  int clientPointer[HTTP_CONNECTIONS];
+  boolean clientChunked[HTTP_CONNECTIONS];
 };
 
 inline unsigned long Platform::Time()
@@ -302,77 +532,192 @@ inline unsigned long Platform::Time()
   return micros();
 }
 
+inline int Platform::GCodeCount()
+{
+  return gcodeCount;
+}
+
+inline unsigned long Platform::Cycles()
+{
+  return DWT->CYCCNT;
+}
+
 //***************************************************************************************
 
 // Network connection
 
+inline void Platform::SelectClient(int c)
+{
+  client = c;
+}
+
 inline int Platform::ClientStatus()
 {
-  return clientStatus;
+  return clientStatus[client];
 }
 
 inline void Platform::SendToClient(unsigned char b)
 {
-  if(client)
-  {
-    client.write(b);
-    //Serial.write(b);
-  } else
-    Message(HOST_MESSAGE, "Attempt to send byte to disconnected client.");
+  clientBuffer[client][CHUNK_HEADER + clientPointer[client]] = b;
+  clientPointer[client]++;
+  if(clientPointer[client] >= CLIENT_CHUNK)
+    FlushClient();
+}
+
+inline void Platform::ChunkClientOutput()
+{
+  FlushClient();
+  clientChunked[client] = true;
 }
 
 inline unsigned char Platform::ClientRead()
 {
-  if(client)
-    return client.read();
+  if(clients[client])
+    return clients[client].read();
     
   Message(HOST_MESSAGE, "Attempt to read from disconnected client.");
   return '\n'; // good idea?? 
 }
 
+inline int Platform::ClientRead(char* b, int length)
+{
+  if(!clients[client])
+  {
+    Message(HOST_MESSAGE, "Attempt to read from disconnected client.");
+    return 0;
+  }
+  int n = clients[client].read((uint8_t*)b, length);
+  if(n < 0)
+    return 0;
+  return n;
+}
+
+// Take on any new connection that there is room for, and see what all of them are doing.
+// The server only hands back the lowest-numbered socket with something to read, so a busy
+// connection can hide the others from it; instead every socket is looked at here.  One that
+// is connected to our port but isn't one of ours is new, and is closed if there's no room.
+
 inline void Platform::ClientMonitor()
 {
-  clientStatus = 0;
+  int i;
+  server->available(); // Keeps a socket listening for new connections
+  for(byte sock = 0; sock < MAX_SOCK_NUM; sock++)
+  {
+    if(EthernetClass::_server_port[sock] != HTTP_PORT)
+      continue;
+    EthernetClient c(sock);
+    byte s = c.status();
+    if(s != SnSR::ESTABLISHED && s != SnSR::CLOSE_WAIT)
+      continue;
+    boolean held = false;
+    int spare = -1;
+    for(i = 0; i < HTTP_CONNECTIONS; i++)
+    {
+      if(clients[i] && clients[i] == c)
+      {
+        held = true;
+        break;
+      }
+      if(!clients[i] && spare < 0)
+        spare = i;
+    }
+    if(held)
+      continue;
+    if(spare < 0)
+    {
+      c.stop();
+      continue;
+    }
+    clients[spare] = c;
+    clientPointer[spare] = 0;
+    clientChunked[spare] = false;
+  }
   
-  if(!client)
+  for(i = 0; i < HTTP_CONNECTIONS; i++)
   {
-    client = server->available();
-    if(!client)
-      return;
-    //else
-      //Serial.println("new client");
+    clientStatus[i] = 0;
+    if(!clients[i])
+      continue;
+    clientStatus[i] |= CLIENT;
+    if(!clients[i].connected())
+      continue;
+    clientStatus[i] |= CONNECTED;
+    if(clients[i].available())
+      clientStatus[i] |= AVAILABLE;
   }
-    
-  clientStatus |= CLIENT;
-    
-  if(!client.connected())
-    return;
-    
-  clientStatus |= CONNECTED;
-    
-  if (!client.available())
-    return;
-    
-  clientStatus |= AVAILABLE;
 }
 
 inline void Platform::DisconnectClient()
 {
-  if (client)
+  if (clients[client])
   {
-    client.stop();
+    EndClientOutput();
+    clients[client].stop();
+    clientStatus[client] = 0;
     //Serial.println("client disconnected");
   } else
       Message(HOST_MESSAGE, "Attempt to disconnect non-existent client.");
 }
 
+inline boolean Platform::SerialAvailable()
+{
+  return Serial.available() > 0;
+}
+
+inline unsigned char Platform::SerialRead()
+{
+  return (unsigned char)Serial.read();
+}
+
+inline float Platform::CacheHitRate()
+{
+  if(!(cacheHits + cacheMisses))
+    return 0.0;
+  return (float)cacheHits/(float)(cacheHits + cacheMisses);
+}
+
+inline unsigned long Platform::FileBytesPerSecond()
+{
+  return bytesPerSecond;
+}
+
+inline unsigned long Platform::MessagesDropped()
+{
+  return messagesDropped;
+}
+
+inline unsigned long Platform::LastFlushTime()
+{
+  return lastFlushTime;
+}
+
+inline unsigned long Platform::MaxFlushTime()
+{
+  return maxFlushTime;
+}
+
+inline void Platform::Message(char type, char* message)
+{
+  Message(type, message, LOG_INFO);
+}
+
 //*****************************************************************************************************************
 
 // Interrupts
 
-inline void Platform::SetInterrupt(long t)
+// The counter went back to 0 when this interrupt was due.  If the interrupt has run so late
+// that the counter has passed ticks already, setting RC to it would only match after the
+// counter had gone all the way round 2^32 - so the next interrupt comes as soon as it can.
+
+inline void Platform::NextInterrupt(unsigned long ticks)
 {
-  
+  unsigned long soonest = STEP_TIMER->TC_CHANNEL[STEP_TIMER_CHANNEL].TC_CV + STEP_TIMER_MARGIN;
+  STEP_TIMER->TC_CHANNEL[STEP_TIMER_CHANNEL].TC_RC = ticks > soonest ? ticks : soonest;
+}
+
+inline unsigned long Platform::InterruptLatency()
+{
+  return STEP_TIMER->TC_CHANNEL[STEP_TIMER_CHANNEL].TC_CV;
 }
 
 inline void Platform::Interrupt()
@@ -386,17 +731,166 @@ inline void Platform::Interrupt()
 
 inline void Platform::SetDirection(byte drive, bool direction)
 {
-  digitalWrite(directionPins[drive], direction);  
+  if(!directionMasks[drive])
+    return;
+  if(direction)
+    directionPorts[drive]->PIO_SODR = directionMasks[drive];
+  else
+    directionPorts[drive]->PIO_CODR = directionMasks[drive];
+  if(!driveEnabled[drive] && enableMasks[drive])
+  {
+    if(ENABLE)
+      enablePorts[drive]->PIO_SODR = enableMasks[drive];
+    else
+      enablePorts[drive]->PIO_CODR = enableMasks[drive];
+    driveEnabled[drive] = true;
+  }
+}
+
+// The drivers step on the rising edge
+
+inline void Platform::StepDrives(byte drives)
+{
+  uint32_t bits[DRIVES];
+  byte i;
+  for(i = 0; i < stepPortCount; i++)
+    bits[i] = 0;
+  for(i = 0; i < DRIVES; i++)
+  {
+    if(drives & (1 << i))
+      bits[stepPortIndex[i]] |= stepMasks[i];
+  }
+  for(i = 0; i < stepPortCount; i++)
+  {
+    if(bits[i])
+      stepPortList[i]->PIO_SODR = bits[i];
+  }
+  delayMicroseconds(STEP_PULSE_LENGTH);
+  for(i = 0; i < stepPortCount; i++)
+  {
+    if(bits[i])
+      stepPortList[i]->PIO_CODR = bits[i];
+  }
+}
+
+// Endstops are read straight from their ports, so they can be checked before every step
+
+inline boolean Platform::Stopped(byte axis, bool direction)
+{
+  if(!stopMasks[axis][direction])
+    return false;
+  return ((stopPorts[axis][direction]->PIO_PDSR & stopMasks[axis][direction]) != 0) == (ENDSTOP_HIT != 0);
+}
+
+inline int Platform::HomingDirection(byte axis)
+{
+  if(stopMasks[axis][BACKWARDS])
+    return BACKWARDS;
+  if(stopMasks[axis][FORWARDS])
+    return FORWARDS;
+  return -1;
+}
+
+inline float Platform::HomeFeedrate(byte axis)
+{
+  return config.fastHomeFeedrates[axis]/60.0;
+}
+
+inline float Platform::AxisLength(byte axis)
+{
+  return config.axisLengths[axis];
+}
+
+inline boolean Platform::ZProbe()
+{
+  return Stopped(Z_AXIS, BACKWARDS);
 }
 
 inline void Platform::Step(byte drive)
 {
-  digitalWrite(stepPins[drive], !digitalRead(stepPins[drive]));
+  StepDrives(1 << drive);
+}
+
+inline float Platform::DriveStepsPerUnit(byte drive)
+{
+  return config.driveStepsPerUnit[drive];
+}
+
+inline float Platform::MaxFeedrate(byte drive)
+{
+  return config.maxFeedrates[drive];
+}
+
+inline float Platform::Acceleration(byte drive)
+{
+  return config.maxAccelerations[drive];
+}
+
+inline float Platform::Jerk(byte drive)
+{
+  return config.jerks[drive];
+}
+
+inline boolean Platform::DriveRelativeMode(byte drive)
+{
+  return config.driveRelativeModes[drive];
+}
+
+inline boolean Platform::UsePID(byte heater)
+{
+  return config.usePid[heater];
+}
+
+inline float Platform::PidKp(byte heater)
+{
+  return config.pidKps[heater];
+}
+
+inline float Platform::PidKi(byte heater)
+{
+  return config.pidKis[heater];
+}
+
+inline float Platform::PidKd(byte heater)
+{
+  return config.pidKds[heater];
+}
+
+inline float Platform::PidILimit(byte heater)
+{
+  return config.pidILimits[heater];
+}
+
+inline void Platform::SetPid(byte heater, float kp, float ki, float kd)
+{
+  config.pidKps[heater] = kp;
+  config.pidKis[heater] = ki;
+  config.pidKds[heater] = kd;
+}
+
+inline void Platform::SetDriveStepsPerUnit(byte drive, float value)
+{
+  config.driveStepsPerUnit[drive] = value;
+}
+
+inline void Platform::SetMaxFeedrate(byte drive, float value)
+{
+  config.maxFeedrates[drive] = value;
+}
+
+inline void Platform::SetAcceleration(byte drive, float value)
+{
+  config.maxAccelerations[drive] = value;
+}
+
+inline unsigned long Platform::ConfigLoadTime()
+{
+  return configLoadTime;
 }
 
 inline int Platform::GetRawTemperature(byte heater)
 {
-  return analogRead(tempSensePins[heater]);
+  return analogRead(config.tempSensePins[heater]);
 }
 
 #endif
@@ -34,8 +34,51 @@ void loop()
   reprap.Spin();
 }
 
+// The step timer interrupt
+
+void TC3_Handler()
+{
+  TC_GetStatus(STEP_TIMER, STEP_TIMER_CHANNEL);
+  reprap.GetPlatform()->Interrupt();
+}
+
 //*************************************************************************************************
 
+// The settings to use when there is no good image on the SD card
+
+const MachineConfig defaultConfig =
+{
+  CONFIG_MAGIC,
+  CONFIG_VERSION,
+  sizeof(MachineConfig),
+  STEP_PINS,
+  DIRECTION_PINS,
+  ENABLE_PINS,
+  DISABLE_DRIVES,
+  MAX_FEEDRATES,
+  MAX_ACCELERATIONS,
+  DRIVE_STEPS_PER_UNIT,
+  JERKS,
+  DRIVE_RELATIVE_MODES,
+  LOW_STOP_PINS,
+  HIGH_STOP_PINS,
+  AXIS_LENGTHS,
+  FAST_HOME_FEEDRATES,
+  TEMP_SENSE_PINS,
+  HEAT_ON_PINS,
+  THERMISTOR_BETAS,
+  THERMISTOR_SERIES_RS,
+  THERMISTOR_25_RS,
+  USE_PID,
+  PID_KIS,
+  PID_KDS,
+  PID_KPS,
+  PID_I_LIMITS,
+  MAC,
+  {IP0, IP1, IP2, IP3},
+  0
+};
+
 Platform::Platform(RepRap* r)
 {
   reprap = r;
@@ -51,96 +94,124 @@ void Platform::Init()
   
   lastTime = Time();
   
-  if(!LoadFromStore())
-  {     
-  // DRIVES
-  
-    stepPins = STEP_PINS;
-    directionPins = DIRECTION_PINS;
-    enablePins = ENABLE_PINS;
-    disableDrives = DISABLE_DRIVES;
-    maxFeedrates = MAX_FEEDRATES;
-    maxAccelerations = MAX_ACCELERATIONS;
-    driveStepsPerUnit = DRIVE_STEPS_PER_UNIT;
-    jerks = JERKS;
-    driveRelativeModes = DRIVE_RELATIVE_MODES;
-    
-  // AXES
-  
-    lowStopPins = LOW_STOP_PINS;
-    highStopPins = HIGH_STOP_PINS;
-    axisLengths = AXIS_LENGTHS;
-    fastHomeFeedrates = FAST_HOME_FEEDRATES;
-   
-  // HEATERS - Bed is assumed to be the first
-  
-    tempSensePins = TEMP_SENSE_PINS;
-    heatOnPins = HEAT_ON_PINS;
-    thermistorBetas = THERMISTOR_BETAS;
-    thermistorSeriesRs = THERMISTOR_SERIES_RS;
-    thermistorInfRs = THERMISTOR_25_RS;
-    usePid = USE_PID;
-    pidKis = PID_KIS;
-    pidKds = PID_KDS;
-    pidKps = PID_KPS;
-    pidILimits = PID_I_LIMITS;
-    webDir = WEB_DIR;
-    gcodeDir = GCODE_DIR;
-    sysDir = SYS_DIR;
-    tempDir = TEMP_DIR;
+  // Start the processor's cycle counter for Cycles()
+  
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  
+  logged = 0;
+  logFlushed = 0;
+  lastMessageTime = lastTime;
+  messagesDropped = 0;
+  lastFlushTime = 0;
+  maxFlushTime = 0;
+  logFileFailed = false;
+  logLineStart = true;
+  
+  webDir = WEB_DIR;
+  gcodeDir = GCODE_DIR;
+  sysDir = SYS_DIR;
+  tempDir = TEMP_DIR;
+
+  // Files
+ 
+  files = new File[MAX_FILES];
+  inUse = new boolean[MAX_FILES];
+  for(i=0; i < MAX_FILES; i++)
+  {
+    buf[i] = new byte[FILE_BUF_LEN];
+    bPointer[i] = 0;
+    inUse[i] = false;
+    writing[i] = false;
+  }
+  for(i = 0; i < CACHE_BLOCKS; i++)
+  {
+    cacheHash[i] = 0;
+    cacheUsed[i] = 0;
   }
+  cacheClock = 0;
+  for(i = 0; i < FILE_CHANGE_SLOTS; i++)
+    changeCounts[i] = 0;
+  cacheHits = 0;
+  cacheMisses = 0;
+  bytesRead = 0;
+  lastBytesRead = 0;
+  bytesPerSecond = 0;
+  
+  // The settings are on the SD card, so start that first.  Keep the W5100 off the SPI bus
+  // until the network is started.
+  
+  pinMode(ETH_B_PIN, OUTPUT);
+  digitalWrite(ETH_B_PIN, HIGH);
+  if (!SD.begin(SD_SPI)) 
+     Serial.println("SD initialization failed.");
+  // SD.begin() returns with the SPI disabled, so you need not disable it here  
+  char* sidecarDir = PrependRoot(GetSysDir(), SIDECAR_DIR);
+  if(!SD.exists(sidecarDir))
+    SD.mkdir(sidecarDir);
+  
+  configLoadTime = Time();
+  if(!LoadFromStore())
+    config = defaultConfig;
+  configLoadTime = Time() - configLoadTime;
   
   for(i = 0; i < DRIVES; i++)
   {
-    if(stepPins[i] >= 0)
-      pinMode(stepPins[i], OUTPUT);
-    if(directionPins[i] >= 0)  
-      pinMode(directionPins[i], OUTPUT);
-    if(enablePins[i] >= 0)
+    if(config.stepPins[i] >= 0)
+    {
+      pinMode(config.stepPins[i], OUTPUT);
+      digitalWrite(config.stepPins[i], LOW);
+    }
+    if(config.directionPins[i] >= 0)  
+      pinMode(config.directionPins[i], OUTPUT);
+    if(config.enablePins[i] >= 0)
     {  
-      pinMode(enablePins[i], OUTPUT);
-      digitalWrite(enablePins[i], ENABLE);
+      pinMode(config.enablePins[i], OUTPUT);
+      digitalWrite(config.enablePins[i], ENABLE);
     }
   }
+  InitialisePorts();
   
   for(i = 0; i < AXES; i++)
   {
-    if(lowStopPins[i] >= 0)
+    if(config.lowStopPins[i] >= 0)
     {
-      pinMode(lowStopPins[i], INPUT);
-      digitalWrite(lowStopPins[i], HIGH); // Turn on pullup
+      pinMode(config.lowStopPins[i], INPUT);
+      digitalWrite(config.lowStopPins[i], HIGH); // Turn on pullup
     }
-    if(highStopPins[i] >= 0)
+    if(config.highStopPins[i] >= 0)
     {
-      pinMode(highStopPins[i], INPUT);
-      digitalWrite(highStopPins[i], HIGH); // Turn on pullup
+      pinMode(config.highStopPins[i], INPUT);
+      digitalWrite(config.highStopPins[i], HIGH); // Turn on pullup
     }
   }  
   
   
   for(i = 0; i < HEATERS; i++)
   {
-    if(heatOnPins[i] >= 0)
-      pinMode(heatOnPins[i], OUTPUT);
-    //Serial.println(thermistorInfRs[i]);
-    thermistorInfRs[i] = ( thermistorInfRs[i]*exp(-thermistorBetas[i]/(25.0 - ABS_ZERO)) );
-    //Serial.println(thermistorInfRs[i]);
+    if(config.heatOnPins[i] >= 0)
+      pinMode(config.heatOnPins[i], OUTPUT);
+    thermistorInfRs[i] = ( config.thermistor25Rs[i]*exp(-config.thermistorBetas[i]/(25.0 - ABS_ZERO)) );
   }  
-
-  // Files
- 
-  files = new File[MAX_FILES];
-  inUse = new boolean[MAX_FILES];
-  for(i=0; i < MAX_FILES; i++)
+  
+  // Work out the temperature for evenly-spaced A->D values once, so reading a temperature
+  // is a table look-up.  Start the filters from a full sample.
+  
+  int j;
+  for(i = 0; i < HEATERS; i++)
   {
-    buf[i] = new byte[FILE_BUF_LEN];
-    bPointer[i] = 0;
-    inUse[i] = false;
+    for(j = 0; j < TEMP_TABLE_LENGTH; j++)
+      temperatureTable[i][j] = (long)(TEMP_FRACTION*ThermistorTemperature(i, (float)(j << TEMP_TABLE_SHIFT)/(float)(1 << TEMP_OVERSAMPLE_SHIFT)));
+    adcFiltered[i] = 0;
+    for(j = 0; j < (1 << TEMP_OVERSAMPLE_SHIFT); j++)
+      adcFiltered[i] += GetRawTemperature(i);
+    adcSum[i] = 0;
   }
+  adcCount = 0;
   
   // Network
 
-  mac = MAC;
   server = new EthernetServer(HTTP_PORT);
   
   // disable SD SPI while starting w5100
@@ -148,7 +219,7 @@ void Platform::Init()
   pinMode(SD_SPI, OUTPUT);
   digitalWrite(SD_SPI,HIGH);   
 
-  Ethernet.begin(mac, *(new IPAddress(IP0, IP1, IP2, IP3)));
+  Ethernet.begin(config.mac, *(new IPAddress(config.ip[0], config.ip[1], config.ip[2], config.ip[3])));
   server->begin();
   
   //Serial.print("server is at ");
@@ -158,23 +229,32 @@ void Platform::Init()
   // even tho the call to Ethernet.localIP() does the same thing
   digitalWrite(ETH_B_PIN, HIGH);
   
-  clientStatus = 0;
+  for(i = 0; i < HTTP_CONNECTIONS; i++)
+  {
+    clientStatus[i] = 0;
+    clientPointer[i] = 0;
+    clientChunked[i] = false;
+  }
   client = 0;
- 
-  if (!SD.begin(SD_SPI)) 
-     Serial.println("SD initialization failed.");
-  // SD.begin() returns with the SPI disabled, so you need not disable it here  
+  
+  IndexGCodes();
   
     // Reinitialise the message file
   
   DeleteFile(PrependRoot(GetWebDir(), MESSAGE_FILE));
   int m = OpenFile(PrependRoot(GetWebDir(), MESSAGE_TEMPLATE), false);
   int n = OpenFile(PrependRoot(GetWebDir(), MESSAGE_FILE), true);
-  byte b;
-  while (Read(m, b))
-    Write(n,b);
-  Close(m);  
-  Close(n);
+  int count;
+  if(m >= 0 && n >= 0)
+    while((count = Read(m, scratchString, STRING_LENGTH)) > 0)
+      Write(n, scratchString, count);
+  if(m >= 0)
+    Close(m);
+  if(n >= 0)
+    Close(n);
+  
+  sprintf(scratchString, "Settings loaded in %lu us.<br>\n", configLoadTime);
+  Message(HOST_MESSAGE, scratchString);
   
   active = true;
 }
@@ -197,13 +277,188 @@ char* Platform::PrependRoot(char* root, char* fileName)
 }
 
 
-// Load settings from local storage; return true if successful, false otherwise
+// Look up the I/O port and bit of each drive pin and endstop once, so the drives can be
+// driven and the endstops read without going through digitalWrite() and digitalRead().
+// Unused pins get a zero mask.
+
+void Platform::InitialisePorts()
+{
+  byte i, j;
+  stepPortCount = 0;
+  for(i = 0; i < DRIVES; i++)
+  {
+    stepPorts[i] = 0;
+    stepMasks[i] = 0;
+    stepPortIndex[i] = 0;
+    if(config.stepPins[i] >= 0)
+    {
+      stepPorts[i] = g_APinDescription[(int)config.stepPins[i]].pPort;
+      stepMasks[i] = g_APinDescription[(int)config.stepPins[i]].ulPin;
+      for(j = 0; j < stepPortCount; j++)
+      {
+        if(stepPortList[j] == stepPorts[i])
+          break;
+      }
+      if(j >= stepPortCount)
+        stepPortList[stepPortCount++] = stepPorts[i];
+      stepPortIndex[i] = j;
+    }
+    
+    directionPorts[i] = 0;
+    directionMasks[i] = 0;
+    if(config.directionPins[i] >= 0)
+    {
+      directionPorts[i] = g_APinDescription[(int)config.directionPins[i]].pPort;
+      directionMasks[i] = g_APinDescription[(int)config.directionPins[i]].ulPin;
+    }
+    
+    enablePorts[i] = 0;
+    enableMasks[i] = 0;
+    if(config.enablePins[i] >= 0)
+    {
+      enablePorts[i] = g_APinDescription[(int)config.enablePins[i]].pPort;
+      enableMasks[i] = g_APinDescription[(int)config.enablePins[i]].ulPin;
+    }
+    driveEnabled[i] = true;
+  }
+  
+  for(i = 0; i < AXES; i++)
+  {
+    stopPorts[i][BACKWARDS] = 0;
+    stopMasks[i][BACKWARDS] = 0;
+    if(config.lowStopPins[i] >= 0)
+    {
+      stopPorts[i][BACKWARDS] = g_APinDescription[(int)config.lowStopPins[i]].pPort;
+      stopMasks[i][BACKWARDS] = g_APinDescription[(int)config.lowStopPins[i]].ulPin;
+    }
+    stopPorts[i][FORWARDS] = 0;
+    stopMasks[i][FORWARDS] = 0;
+    if(config.highStopPins[i] >= 0)
+    {
+      stopPorts[i][FORWARDS] = g_APinDescription[(int)config.highStopPins[i]].pPort;
+      stopMasks[i][FORWARDS] = g_APinDescription[(int)config.highStopPins[i]].ulPin;
+    }
+  }
+}
+
+// Drives are re-enabled by the next SetDirection(), which starts every move
+
+void Platform::Disable(byte drive)
+{
+  if(!enableMasks[drive])
+    return;
+  if(DISABLE)
+    enablePorts[drive]->PIO_SODR = enableMasks[drive];
+  else
+    enablePorts[drive]->PIO_CODR = enableMasks[drive];
+  driveEnabled[drive] = false;
+}
+
+// Set a regular interrupt going every t microseconds; if t is -ve turn interrupt off.
+// Interrupt() can change the period by calling NextInterrupt().
+
+void Platform::SetInterrupt(long t)
+{
+  if(t <= 0)
+  {
+    NVIC_DisableIRQ(STEP_TIMER_IRQ);
+    TC_Stop(STEP_TIMER, STEP_TIMER_CHANNEL);
+    return;
+  }
+
+  pmc_set_writeprotect(false);
+  pmc_enable_periph_clk((uint32_t)STEP_TIMER_IRQ);
+  TC_Configure(STEP_TIMER, STEP_TIMER_CHANNEL, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK1);
+  TC_SetRC(STEP_TIMER, STEP_TIMER_CHANNEL, (uint32_t)t*STEP_CLOCK_MICROSECOND);
+  STEP_TIMER->TC_CHANNEL[STEP_TIMER_CHANNEL].TC_IER = TC_IER_CPCS;
+  STEP_TIMER->TC_CHANNEL[STEP_TIMER_CHANNEL].TC_IDR = ~TC_IER_CPCS;
+  TC_Start(STEP_TIMER, STEP_TIMER_CHANNEL);
+  NVIC_ClearPendingIRQ(STEP_TIMER_IRQ);
+  NVIC_EnableIRQ(STEP_TIMER_IRQ);
+}
+
+// Load settings from local storage; return true if successful, false otherwise.
+// The image is read straight into config in one go and then checked.
 
 bool Platform::LoadFromStore()
 {
+  char* fileName = PrependRoot(GetSysDir(), CONFIG_FILE);
+  if(!SD.exists(fileName))
+    return false;
+  int file = OpenFile(fileName, false);
+  if(file < 0)
+    return false;
+  int n = Read(file, (char*)&config, sizeof(MachineConfig));
+  Close(file);
+  if(n == sizeof(MachineConfig) && config.magic == CONFIG_MAGIC && config.version == CONFIG_VERSION &&
+      config.length == sizeof(MachineConfig) && config.crc == ConfigCRC())
+    return true;
+  Message(HOST_MESSAGE, "The settings file is damaged or out of date; using the defaults.<br>\n", LOG_WARNING);
   return false;
 }
 
+boolean Platform::SaveToStore()
+{
+  config.magic = CONFIG_MAGIC;
+  config.version = CONFIG_VERSION;
+  config.length = sizeof(MachineConfig);
+  config.crc = ConfigCRC();
+  DeleteFile(PrependRoot(GetSysDir(), CONFIG_FILE));
+  int file = OpenFile(PrependRoot(GetSysDir(), CONFIG_FILE), true);
+  if(file < 0)
+  {
+    Message(HOST_MESSAGE, "Can't save the settings.<br>\n", LOG_ERROR);
+    return false;
+  }
+  Write(file, (char*)&config, sizeof(MachineConfig));
+  Close(file);
+  return true;
+}
+
+// Only the settings that can be changed while running are taken back; pins and network
+// addresses need a restart.
+
+boolean Platform::ReloadFromStore()
+{
+  MachineConfig running = config;
+  boolean loaded = LoadFromStore();
+  if(!loaded)
+    config = defaultConfig;
+  memcpy(config.stepPins, running.stepPins, sizeof(config.stepPins));
+  memcpy(config.directionPins, running.directionPins, sizeof(config.directionPins));
+  memcpy(config.enablePins, running.enablePins, sizeof(config.enablePins));
+  memcpy(config.lowStopPins, running.lowStopPins, sizeof(config.lowStopPins));
+  memcpy(config.highStopPins, running.highStopPins, sizeof(config.highStopPins));
+  memcpy(config.tempSensePins, running.tempSensePins, sizeof(config.tempSensePins));
+  memcpy(config.heatOnPins, running.heatOnPins, sizeof(config.heatOnPins));
+  memcpy(config.thermistorBetas, running.thermistorBetas, sizeof(config.thermistorBetas));
+  memcpy(config.thermistorSeriesRs, running.thermistorSeriesRs, sizeof(config.thermistorSeriesRs));
+  memcpy(config.thermistor25Rs, running.thermistor25Rs, sizeof(config.thermistor25Rs));
+  memcpy(config.mac, running.mac, sizeof(config.mac));
+  memcpy(config.ip, running.ip, sizeof(config.ip));
+  return loaded;
+}
+
+// CRC-32 (the one Ethernet and zip use) of config up to its crc, a nibble at a time
+
+unsigned long Platform::ConfigCRC()
+{
+  static const unsigned long crcTable[16] = 
+  {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C, 
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  byte* p = (byte*)&config;
+  int length = (byte*)&config.crc - p;
+  unsigned long crc = 0xFFFFFFFF;
+  for(int i = 0; i < length; i++)
+  {
+    crc = crcTable[(crc ^ p[i]) & 0xF] ^ (crc >> 4);
+    crc = crcTable[(crc ^ (p[i] >> 4)) & 0xF] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
 //===========================================================================
 //=============================Thermal Settings  ============================
 //===========================================================================
@@ -222,13 +477,48 @@ bool Platform::LoadFromStore()
 // To get degrees celsius (instead of kelvin) add -273.15 to T
 //#define THERMISTOR_R_INFS ( THERMISTOR_25_RS*exp(-THERMISTOR_BETAS/298.15) ) // Compute in Platform constructor
 
-// Result is in degrees celsius
+// r is the A->D reading; the ends of the range are pulled in a bit, as the equation
+// goes infinite there.  Result is in degrees celsius
+
+float Platform::ThermistorTemperature(byte heater, float r)
+{
+  if(r < 0.5)
+    r = 0.5;
+  if(r > AD_RANGE - 0.5)
+    r = AD_RANGE - 0.5;
+  return ABS_ZERO + config.thermistorBetas[heater]/log( (r*config.thermistorSeriesRs[heater]/(AD_RANGE - r))/thermistorInfRs[heater] );
+}
+
+// Called from Spin(), which the scheduler runs every TEMP_SAMPLE_INTERVAL.  Each heater's
+// thermistor is read once a call; when there are enough readings for a sample it goes into the filter.
+
+void Platform::SampleTemperatures()
+{
+  byte i;
+  for(i = 0; i < HEATERS; i++)
+    adcSum[i] += GetRawTemperature(i);
+  adcCount++;
+  if(adcCount < (1 << TEMP_OVERSAMPLE_SHIFT))
+    return;
+  for(i = 0; i < HEATERS; i++)
+  {
+    adcFiltered[i] += (adcSum[i] - adcFiltered[i])/(1 << TEMP_FILTER_SHIFT);
+    adcSum[i] = 0;
+  }
+  adcCount = 0;
+}
+
+// Result is in degrees celsius, interpolated in the table from the filtered A->D sample
 
 float Platform::GetTemperature(byte heater)
 {
-  float r = (float)GetRawTemperature(heater);
-  //Serial.println(r);
-  return ABS_ZERO + thermistorBetas[heater]/log( (r*thermistorSeriesRs[heater]/(AD_RANGE - r))/thermistorInfRs[heater] );
+  long v = adcFiltered[heater];
+  int i = v >> TEMP_TABLE_SHIFT;
+  long* t = &temperatureTable[heater][i];
+  if(i >= TEMP_TABLE_LENGTH - 1)
+    return (float)t[0]/TEMP_FRACTION;
+  long f = v & ((1 << TEMP_TABLE_SHIFT) - 1);
+  return (float)(t[0] + (((t[1] - t[0])*f) >> TEMP_TABLE_SHIFT))/TEMP_FRACTION;
 }
 
 
@@ -238,18 +528,18 @@ void Platform::SetHeater(byte heater, const float& power)
 {
   if(power <= 0)
   {
-     digitalWrite(heatOnPins[heater], 0);
+     digitalWrite(config.heatOnPins[heater], 0);
      return;
   }
   
   if(power >= 1.0)
   {
-     digitalWrite(heatOnPins[heater], 1);
+     digitalWrite(config.heatOnPins[heater], 1);
      return;
   }
   
   byte p = (byte)(255.0*power);
-  analogWrite(heatOnPins[heater], p);
+  analogWrite(config.heatOnPins[heater], p);
 }
 
 
@@ -298,12 +588,182 @@ char* Platform::FileList(char* directory)
   return fileList;
 }
 
+// Read the G Code directory once; from then on the index is kept up to date as files are
+// uploaded and deleted.
+
+void Platform::IndexGCodes()
+{
+  gcodeCount = 0;
+  gcodeClock = 0;
+  File dir, entry;
+  dir = SD.open(GetGcodeDir());
+  if(dir)
+  {
+    while(entry = dir.openNextFile())
+    {
+      if(!entry.isDirectory())
+        IndexGCode(entry.name(), entry.size());
+      entry.close();
+    }
+    dir.close();
+  }
+  SortGCodes();
+}
+
+// The index entry for a file, which may or may not have the directory in front; -1 if none.
+
+int Platform::FindGCode(char* fileName)
+{
+  int n = strlen(GetGcodeDir());
+  if(!strncasecmp(fileName, GetGcodeDir(), n))
+    fileName += n;
+  for(int i = 0; i < gcodeCount; i++)
+    if(!strcasecmp(fileName, gcodeNames[i]))
+      return i;
+  return -1;
+}
+
+void Platform::IndexGCode(char* fileName, unsigned long length)
+{
+  int i = FindGCode(fileName);
+  if(i < 0)
+  {
+    int n = strlen(GetGcodeDir());
+    if(!strncasecmp(fileName, GetGcodeDir(), n))
+      fileName += n;
+    if(gcodeCount >= GCODE_INDEX_LENGTH || strlen(fileName) >= INDEX_NAME_LENGTH)
+    {
+      Message(HOST_MESSAGE, "G Code file not listed: ", LOG_WARNING);
+      Message(HOST_MESSAGE, fileName);
+      Message(HOST_MESSAGE, "<br>\n");
+      return;
+    }
+    i = gcodeCount++;
+    strcpy(gcodeNames[i], fileName);
+  }
+  gcodeLengths[i] = length;
+  gcodeAges[i] = gcodeClock++;
+  if(active)
+    SortGCodes();
+}
+
+void Platform::UnindexGCode(char* fileName)
+{
+  int i = FindGCode(fileName);
+  if(i < 0)
+    return;
+  gcodeCount--;
+  strcpy(gcodeNames[i], gcodeNames[gcodeCount]);
+  gcodeLengths[i] = gcodeLengths[gcodeCount];
+  gcodeAges[i] = gcodeAges[gcodeCount];
+  SortGCodes();
+}
+
+boolean Platform::GCodeBefore(int order, int a, int b)
+{
+  switch(order)
+  {
+  case SORT_BY_AGE:
+    return gcodeAges[a] > gcodeAges[b];
+    
+  case SORT_BY_SIZE:
+    return gcodeLengths[a] > gcodeLengths[b];
+    
+  default:
+    return strcasecmp(gcodeNames[a], gcodeNames[b]) < 0;
+  }
+}
+
+// Insertion sort - there aren't many files, and it only happens when one changes.
+
+void Platform::SortGCodes()
+{
+  int i, j;
+  byte e;
+  for(int order = 0; order < GCODE_ORDERS; order++)
+  {
+    byte* list = gcodeOrders[order];
+    for(i = 0; i < gcodeCount; i++)
+    {
+      e = i;
+      for(j = i; j > 0 && GCodeBefore(order, e, list[j - 1]); j--)
+        list[j] = list[j - 1];
+      list[j] = e;
+    }
+  }
+}
+
+char* Platform::GCodeList(int order, int page)
+{
+  if(order < 0 || order >= GCODE_ORDERS)
+    order = SORT_BY_NAME;
+  int p = 0;
+  fileList[0] = 0;
+  for(int i = page*GCODE_LIST_PAGE; i >= 0 && i < gcodeCount && i < (page + 1)*GCODE_LIST_PAGE; i++)
+  {
+    if(p)
+      fileList[p++] = FILE_LIST_SEPARATOR;
+    fileList[p++] = FILE_LIST_BRACKET;
+    strcpy(&fileList[p], gcodeNames[gcodeOrders[order][i]]);
+    p += strlen(&fileList[p]);
+    fileList[p++] = FILE_LIST_BRACKET;
+    fileList[p] = 0;
+  }
+  return fileList;
+}
+
+char* Platform::GCodeLengths(int order, int page)
+{
+  if(order < 0 || order >= GCODE_ORDERS)
+    order = SORT_BY_NAME;
+  int p = 0;
+  fileList[0] = 0;
+  for(int i = page*GCODE_LIST_PAGE; i >= 0 && i < gcodeCount && i < (page + 1)*GCODE_LIST_PAGE; i++)
+    p += snprintf(&fileList[p], FILE_LIST_LENGTH - p, p ? ",%lu" : "%lu", gcodeLengths[gcodeOrders[order][i]]);
+  return fileList;
+}
+
 // Delete a file
 boolean Platform::DeleteFile(char* fileName)
 {
+  Uncache(NameHash(fileName));
   return SD.remove(fileName);
 }
 
+// FAT names are not case sensitive, so neither is this.  0 means an empty cache slot, so it
+// is never returned.
+
+unsigned long Platform::NameHash(char* fileName)
+{
+  unsigned long h = 2166136261ul;
+  int i = 0;
+  while(fileName[i])
+  {
+    h ^= (unsigned long)tolower(fileName[i++]);
+    h *= 16777619ul;
+  }
+  if(!h)
+    h = 1;
+  return h;
+}
+
+// Files with names that hash to the same slot share a change count, so a change to one of
+// them looks like a change to all of them.  That does no harm - the count is only used to
+// tell when something worked out from a file is out of date.
+
+void Platform::Uncache(unsigned long hash)
+{
+  changeCounts[hash % FILE_CHANGE_SLOTS]++;
+  for(int i = 0; i < CACHE_BLOCKS; i++)
+    if(cacheHash[i] == hash)
+      cacheHash[i] = 0;
+}
+
+unsigned long Platform::FileChanges(char* fileName)
+{
+  return changeCounts[NameHash(fileName) % FILE_CHANGE_SLOTS];
+}
+
 // Open a local file (for example on an SD card).
 
 int Platform::OpenFile(char* fileName, boolean write)
@@ -339,7 +799,26 @@ int Platform::OpenFile(char* fileName, boolean write)
     } else
       files[result] = SD.open(fileName, FILE_READ);
   }
+  if(!files[result])
+  {
+    Message(HOST_MESSAGE, "Can't open file.<br>\n");
+    return -1;
+  }
 
+  fileHash[result] = NameHash(fileName);
+  if(strlen(fileName) < CACHE_NAME_LENGTH)
+    strcpy(this->fileName[result], fileName);
+  else
+    this->fileName[result][0] = 0;
+  writing[result] = write;
+  if(write)
+    Uncache(fileHash[result]);
+  else
+  {
+    filePosition[result] = 0;
+    fileLength[result] = files[result].size();
+    fileSlot[result] = -1;
+  }
   inUse[result] = true;
   return result;
 }
@@ -351,19 +830,124 @@ void Platform::GoToEnd(int file)
     Message(HOST_MESSAGE, "Attempt to seek on a non-open file.<br>\n");
     return;
   }
+  if(!writing[file])
+  {
+    filePosition[file] = fileLength[file];
+    return;
+  }
+  if(bPointer[file] != 0)
+    files[file].write(buf[file], bPointer[file]);
+  bPointer[file] = 0;
   unsigned long e = files[file].size();
   files[file].seek(e);
 }
 
-void Platform::Close(int file)
-{ 
+boolean Platform::Seek(int file, unsigned long position)
+{
+  if(!inUse[file])
+  {
+    Message(HOST_MESSAGE, "Attempt to seek on a non-open file.<br>\n");
+    return false;
+  }
+  if(!writing[file])
+  {
+    if(position > fileLength[file])
+      return false;
+    filePosition[file] = position;
+    return true;
+  }
   if(bPointer[file] != 0)
     files[file].write(buf[file], bPointer[file]);
   bPointer[file] = 0;
+  return files[file].seek(position);
+}
+
+unsigned long Platform::Length(int file)
+{
+  if(!inUse[file])
+  {
+    Message(HOST_MESSAGE, "Attempt to size a non-open file.<br>\n");
+    return 0;
+  }
+  if(!writing[file])
+    return fileLength[file];
+  return files[file].size() + bPointer[file];
+}
+
+void Platform::Close(int file)
+{ 
+  if(writing[file])
+  {
+    if(bPointer[file] != 0)
+      files[file].write(buf[file], bPointer[file]);
+    Uncache(fileHash[file]);
+  } else if(!fileName[file][0])
+  {
+    // Nothing else can find these sectors, and the next file to get this number mustn't
+    for(int i = 0; i < CACHE_BLOCKS; i++)
+      if(CachedFrom(i, file))
+        cacheHash[i] = 0;
+  }
+  bPointer[file] = 0;
+  writing[file] = false;
   files[file].close();
   inUse[file] = false;
 }
 
+boolean Platform::CachedFrom(int slot, int file)
+{
+  if(cacheHash[slot] != fileHash[file])
+    return false;
+  if(fileName[file][0])
+    return !strcasecmp(cacheName[slot], fileName[file]);
+  return !cacheName[slot][0] && cacheFile[slot] == file;
+}
+
+// Find the sector that the file's position is in, reading it from the card into the least
+// recently used slot if it isn't in the cache already.
+
+int Platform::CacheSlot(int file)
+{
+  if(filePosition[file] >= fileLength[file])
+    return -1;
+
+  unsigned long block = filePosition[file]/SD_BLOCK_LENGTH;
+  int slot = fileSlot[file];
+  if(slot < 0 || !CachedFrom(slot, file) || cacheBlock[slot] != block)
+  {
+    slot = -1;
+    for(int i = 0; i < CACHE_BLOCKS; i++)
+      if(CachedFrom(i, file) && cacheBlock[i] == block)
+      {
+        slot = i;
+        break;
+      }
+    if(slot < 0)
+    {
+      slot = 0;
+      for(int i = 1; i < CACHE_BLOCKS; i++)
+        if(cacheUsed[i] < cacheUsed[slot])
+          slot = i;
+      cacheHash[slot] = 0;
+      if(!files[file].seek(block*SD_BLOCK_LENGTH))
+        return -1;
+      int n = files[file].read(cache[slot], SD_BLOCK_LENGTH);
+      if(n <= 0)
+        return -1;
+      cacheHash[slot] = fileHash[file];
+      strcpy(cacheName[slot], fileName[file]);
+      cacheFile[slot] = file;
+      cacheBlock[slot] = block;
+      cacheLength[slot] = n;
+      cacheMisses++;
+    } else
+      cacheHits++;
+    fileSlot[file] = slot;
+  }
+  cacheClock++;
+  cacheUsed[slot] = cacheClock;
+  return slot;
+}
 
 boolean Platform::Read(int file, unsigned char& b)
 {
@@ -372,13 +956,47 @@ boolean Platform::Read(int file, unsigned char& b)
     Message(HOST_MESSAGE, "Attempt to read from a non-open file.<br>\n");
     return false;
   }
-    
-  if(!files[file].available())
+
+  int slot = CacheSlot(file);
+  if(slot < 0)
+    return false;
+  int offset = filePosition[file] % SD_BLOCK_LENGTH;
+  if(offset >= cacheLength[slot])
     return false;
-  b = (unsigned char) files[file].read();
+  b = cache[slot][offset];
+  filePosition[file]++;
+  bytesRead++;
   return true;
 }
 
+int Platform::Read(int file, char* b, int length)
+{
+  if(!inUse[file])
+  {
+    Message(HOST_MESSAGE, "Attempt to read from a non-open file.<br>\n");
+    return 0;
+  }
+
+  int count = 0;
+  while(count < length)
+  {
+    int slot = CacheSlot(file);
+    if(slot < 0)
+      break;
+    int offset = filePosition[file] % SD_BLOCK_LENGTH;
+    int n = cacheLength[slot] - offset;
+    if(n <= 0)
+      break;
+    if(n > length - count)
+      n = length - count;
+    memcpy(&b[count], &cache[slot][offset], n);
+    count += n;
+    filePosition[file] += n;
+  }
+  bytesRead += count;
+  return count;
+}
+
 void Platform::Write(int file, char b)
 {
   if(!inUse[file])
@@ -396,6 +1014,40 @@ void Platform::Write(int file, char b)
   //files[file].write(b);
 }
 
+void Platform::Write(int file, char* b, int length)
+{
+  if(!inUse[file])
+  {
+    Message(HOST_MESSAGE, "Attempt to write bytes to a non-open file.<br>\n");
+    return;
+  }
+  int n;
+  while(length > 0)
+  {
+    // Whole blocks go straight to the card without being copied
+    
+    if(!bPointer[file] && length >= FILE_BUF_LEN)
+    {
+      files[file].write((byte*)b, FILE_BUF_LEN);
+      b += FILE_BUF_LEN;
+      length -= FILE_BUF_LEN;
+      continue;
+    }
+    n = FILE_BUF_LEN - bPointer[file];
+    if(n > length)
+      n = length;
+    memcpy(&(buf[file])[bPointer[file]], b, n);
+    bPointer[file] += n;
+    b += n;
+    length -= n;
+    if(bPointer[file] >= FILE_BUF_LEN)
+    {
+      files[file].write(buf[file], FILE_BUF_LEN);
+      bPointer[file] = 0;
+    }
+  }
+}
+
 void Platform::WriteString(int file, char* b)
 {
   if(!inUse[file])
@@ -410,7 +1062,7 @@ void Platform::WriteString(int file, char* b)
 }
 
 
-void Platform::Message(char type, char* message)
+void Platform::Message(char type, char* message, byte severity)
 {
   switch(type)
   {
@@ -425,27 +1077,195 @@ void Platform::Message(char type, char* message)
   case HOST_MESSAGE:
   default:
   
-  
-    int m = OpenFile(PrependRoot(GetWebDir(), MESSAGE_FILE), true);
-    GoToEnd(m);
-    WriteString(m, message);
     Serial.print(message);
-    Close(m);
     
+    // Each line in the log starts with the time in seconds and how serious it is.
+    // A message that won't fit is dropped whole rather than cut short.
+    
+    int length = strlen(message);
+    int prefix = 0;
+    char stamp[30];
+    if(logLineStart)
+    {
+      unsigned long t = Time()/1000;
+      prefix = snprintf(stamp, 30, "[%lu.%03lu] %s", t/1000, t%1000,
+        (severity == LOG_ERROR) ? "Error: " : ((severity == LOG_WARNING) ? "Warning: " : ""));
+    }
+    if(prefix + length > LOG_LENGTH - (long)(logged - logFlushed))
+    {
+      messagesDropped++;
+      return;
+    }
+    Log(stamp, prefix);
+    Log(message, length);
+    if(length)
+      logLineStart = message[length - 1] == '\n';
+    lastMessageTime = Time();
   }
 }
 
-// Send something to the network client
+void Platform::Log(char* s, int length)
+{
+  int n;
+  while(length > 0)
+  {
+    int i = logged & (LOG_LENGTH - 1);
+    n = LOG_LENGTH - i;
+    if(n > length)
+      n = length;
+    memcpy(&logRing[i], s, n);
+    logged += n;
+    s += n;
+    length -= n;
+  }
+}
+
+// Write everything waiting in the log onto the end of the message file in one go.  If the
+// file can't be opened what was waiting is given up on (it stays in RAM until it is
+// overwritten), the failure is reported once, and the file isn't tried again for a while.
+
+void Platform::FlushLog()
+{
+  unsigned long t = Time();
+  unsigned long end = logged;
+  int m = OpenFile(PrependRoot(GetWebDir(), MESSAGE_FILE), true);
+  if(m < 0)
+  {
+    logFlushed = end;
+    logFailTime = Time();
+    if(!logFileFailed)
+    {
+      logFileFailed = true;
+      Message(HOST_MESSAGE, "Platform: can't open the message file; messages are only kept in RAM.<br>\n", LOG_ERROR);
+    }
+    return;
+  }
+  logFileFailed = false;
+  GoToEnd(m);
+  while(logFlushed != end)
+  {
+    int i = logFlushed & (LOG_LENGTH - 1);
+    int n = LOG_LENGTH - i;
+    if((unsigned long)n > end - logFlushed)
+      n = end - logFlushed;
+    Write(m, &logRing[i], n);
+    logFlushed += n;
+  }
+  Close(m);
+  lastFlushTime = Time() - t;
+  if(lastFlushTime > maxFlushTime)
+    maxFlushTime = lastFlushTime;
+}
+
+// Send the messages still in RAM, starting at the first whole line.
+
+void Platform::SendLogToClient()
+{
+  unsigned long start = 0;
+  if(logged > LOG_LENGTH)
+  {
+    start = logged - LOG_LENGTH;
+    while(start < logged && logRing[start & (LOG_LENGTH - 1)] != '\n')
+      start++;
+    start++;
+  }
+  while(start < logged)
+  {
+    int i = start & (LOG_LENGTH - 1);
+    int n = LOG_LENGTH - i;
+    if((unsigned long)n > logged - start)
+      n = logged - start;
+    SendToClient(&logRing[i], n);
+    start += n;
+  }
+}
+
+int Platform::LogTail(char* b, int length)
+{
+  unsigned long start = 0;
+  if(length > LOG_LENGTH)
+    length = LOG_LENGTH;
+  if(logged > (unsigned long)length)
+  {
+    start = logged - length;
+    while(start < logged && logRing[(start - 1) & (LOG_LENGTH - 1)] != '\n')
+      start++;
+  }
+  int n = 0;
+  while(start < logged)
+    b[n++] = logRing[start++ & (LOG_LENGTH - 1)];
+  return n;
+}
+
+// Send something to the network client.  It is collected in a buffer that is written
+// a segment at a time, rather than being sent in lots of tiny packets.
 
 void Platform::SendToClient(char* message)
 {
-  if(client)
+  int i = 0;
+  while(message[i])
+    SendToClient((unsigned char)message[i++]);
+}
+
+void Platform::SendToClient(char* b, int length)
+{
+  int n;
+  while(length > 0)
   {
-    client.print(message);
-    //Serial.print("Sent: ");
-    //Serial.print(message);
-  } else
-    Message(HOST_MESSAGE, "Attempt to send string to disconnected client.<br>\n");
+    n = CLIENT_CHUNK - clientPointer[client];
+    if(n > length)
+      n = length;
+    memcpy(&clientBuffer[client][CHUNK_HEADER + clientPointer[client]], b, n);
+    clientPointer[client] += n;
+    b += n;
+    length -= n;
+    if(clientPointer[client] >= CLIENT_CHUNK)
+      FlushClient();
+  }
+}
+
+// When the output is chunked the chunk's size goes in the space in front of it, and the
+// CR LF that ends it after it, so it still goes in one write.
+
+void Platform::FlushClient()
+{
+  int n = clientPointer[client];
+  if(!n)
+    return;
+  clientPointer[client] = 0;
+  if(!clients[client])
+  {
+    Message(HOST_MESSAGE, "Attempt to send to disconnected client.<br>\n");
+    return;
+  }
+  
+  byte* b = &clientBuffer[client][CHUNK_HEADER];
+  if(clientChunked[client])
+  {
+    b[n++] = '\r';
+    b[n++] = '\n';
+    *(--b) = '\n';
+    *(--b) = '\r';
+    n += 2;
+    int size = n - 4;
+    do
+    {
+      *(--b) = "0123456789ABCDEF"[size & 0xF];
+      size >>= 4;
+      n++;
+    } while(size);
+  }
+  clients[client].write(b, n);
+}
+
+void Platform::EndClientOutput()
+{
+  FlushClient();
+  if(!clientChunked[client])
+    return;
+  clientChunked[client] = false;
+  if(clients[client])
+    clients[client].write((const uint8_t*)"0\r\n\r\n", 5);
 }
 
 // Where the php/htm etc files are
@@ -488,9 +1308,20 @@ void Platform::Spin()
     return;
     
    ClientMonitor();
+   SampleTemperatures();
+   if(logged != logFlushed && (Time() - lastMessageTime > LOG_FLUSH_DELAY || logged - logFlushed > LOG_LENGTH/2))
+   {
+     if(!logFileFailed || Time() - logFailTime > LOG_RETRY_DELAY)
+       FlushLog();
+     else
+       logFlushed = logged; // Nowhere to write it yet
+   }
    if(Time() - lastTime < 2000000)
      return;
-   lastTime = Time();
+   unsigned long t = Time();
+   bytesPerSecond = (unsigned long)((float)(bytesRead - lastBytesRead)*1000000.0/(float)(t - lastTime));
+   lastBytesRead = bytesRead;
+   lastTime = t;
    //Serial.print("Client status: ");
    //Serial.println(clientStatus);
 }
@@ -28,10 +28,13 @@ Licence: GPL
 #define DATE "2012-11-18"
 #define LAST_AUTHOR "reprappro.com"
 
+#include "Configuration.h"
+
 class Platform;
 class Move;
 class Heat;
 class GCodes;
+class CommandQueue;
 class Webserver;
 
 class RepRap
@@ -43,26 +46,58 @@ class RepRap
     void Spin();
     void Exit();
     
-//    Platform* getPlatform();
-//    Move* getMove();
-//    Heat* getHeat();
-//    GCodes* getGcodes();
+    Platform* GetPlatform();
+    Move* GetMove();
+    Heat* GetHeat();
+    GCodes* GetGCodes();
 //    Webserver* getWebserver();    
     void Interrupt();
+    void Diagnostics(); // Report how the tasks are keeping to time
+    char* ProfileName(int profile);
+    unsigned long Longest(int profile); // Microseconds
+    unsigned long Percentile99(int profile); // Microseconds that 99% of runs took no longer than, to within a factor of 2
+    unsigned long LoopsPerSecond();
     
     
   private:
   
+    int NextTask(unsigned long now);
+    boolean HasWork(int task);
+    void RunTask(int task, unsigned long now);
+    void Record(int profile, unsigned long cycles);
+  
     Platform* platform;
     boolean active;
     Move* move;
     Heat* heat;
     GCodes* gcodes;
+    CommandQueue* commandQueue;
     Webserver* webserver;
+    
+    // The scheduler
+    
+    char* taskNames[PROFILES];
+    unsigned long taskPeriods[TASKS];
+    int taskPriorities[TASKS];
+    unsigned long taskBudgets[TASKS]; // Processor cycles
+    unsigned long taskDue[TASKS]; // When each periodic task is next to run
+    boolean taskPending[TASKS]; // Waiting to run in this pass
+    unsigned long taskMisses[TASKS]; // Periodic tasks that ran a whole period or more late
+    unsigned long taskOverruns[TASKS]; // Runs that took longer than the budget
+    
+    // The profiler
+    
+    unsigned long profileCounts[PROFILES];
+    unsigned long profileLongest[PROFILES]; // Processor cycles
+    unsigned long profileHistograms[PROFILES][PROFILE_BUCKETS]; // Bucket b counts runs of [2^(b-1), 2^b) cycles
+    unsigned long loops;
+    unsigned long loopCountStart;
+    unsigned long loopsPerSecond;
+    char diagnosticString[PROFILE_STRING_LENGTH];
 };
 
-#include "Configuration.h"
 #include "Platform.h"
+#include "Kinematics.h"
 #include "Move.h"
 #include "Heat.h"
 #include "GCodes.h"
@@ -76,14 +111,32 @@ inline RepRap::RepRap()
   platform = new Platform(this);
   move = new Move(platform);
   heat = new Heat(platform);
-  webserver = new Webserver(platform);
-  gcodes = new GCodes(platform, move, heat, webserver);
+  commandQueue = new CommandQueue(platform);
+  webserver = new Webserver(platform, commandQueue);
+  gcodes = new GCodes(platform, move, heat, webserver, commandQueue);
+}
+
+inline Platform* RepRap::GetPlatform() { return platform; }
+
+// Called from the step interrupt as well as the main loop, so it needs to be quick.
+
+inline void RepRap::Record(int profile, unsigned long cycles)
+{
+  profileCounts[profile]++;
+  if(cycles > profileLongest[profile])
+    profileLongest[profile] = cycles;
+  int b = cycles ? 32 - __builtin_clz(cycles) : 0;
+  if(b >= PROFILE_BUCKETS)
+    b = PROFILE_BUCKETS - 1;
+  profileHistograms[profile][b]++;
 }
 
-//inline Platform* RepRap::getPlatform() { return platform; }
-//inline Move* RepRap::getMove() { return move; }
-//inline Heat* RepRap::getHeat() { return heat; }
-//inline GCodes* RepRap::getGcodes() { return gcodes; }
+inline char* RepRap::ProfileName(int profile) { return taskNames[profile]; }
+inline unsigned long RepRap::Longest(int profile) { return profileLongest[profile]/CYCLES_PER_MICROSECOND; }
+inline unsigned long RepRap::LoopsPerSecond() { return loopsPerSecond; }
+inline Move* RepRap::GetMove() { return move; }
+inline Heat* RepRap::GetHeat() { return heat; }
+inline GCodes* RepRap::GetGCodes() { return gcodes; }
 //inline Webserver* RepRap::getWebserver() { return webserver; }  
 
 extern RepRap reprap;
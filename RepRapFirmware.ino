@@ -42,6 +42,7 @@ Licence: GPL
 
 #include <SPI.h>
 #include <Ethernet.h>
+#include <utility/w5100.h>
 #include <SD.h>
 
 #include "RepRapFirmware.h"
@@ -55,12 +56,43 @@ RepRap reprap;
 
 void RepRap::Init()
 {
+  char* names[TASKS] = TASK_NAMES;
+  unsigned long periods[TASKS] = TASK_PERIODS;
+  int priorities[TASKS] = TASK_PRIORITIES;
+  unsigned long budgets[TASKS] = TASK_BUDGETS;
+  int i, j;
+  for(i = 0; i < TASKS; i++)
+  {
+    taskNames[i] = names[i];
+    taskPeriods[i] = periods[i];
+    taskPriorities[i] = priorities[i];
+    taskBudgets[i] = budgets[i]*CYCLES_PER_MICROSECOND;
+    taskMisses[i] = 0;
+    taskOverruns[i] = 0;
+  }
+  taskNames[INTERRUPT_PROFILE] = "Step interrupt";
+  taskNames[LOOP_PROFILE] = "Main loop";
+  for(i = 0; i < PROFILES; i++)
+  {
+    profileCounts[i] = 0;
+    profileLongest[i] = 0;
+    for(j = 0; j < PROFILE_BUCKETS; j++)
+      profileHistograms[i][j] = 0;
+  }
+  
   platform->Init();
   move->Init();
   heat->Init();
+  commandQueue->Init();
   gcodes->Init();
   webserver->Init();
   platform->Message(HOST_MESSAGE, "RepRapPro RepRap Firmware (Re)Started<br>\n");
+  unsigned long now = platform->Time();
+  for(i = 0; i < TASKS; i++)
+    taskDue[i] = now;
+  loops = 0;
+  loopCountStart = now;
+  loopsPerSecond = 0;
   active = true;
 }
 
@@ -74,23 +106,181 @@ void RepRap::Exit()
   platform->Exit();  
 }
 
+// Each pass runs every task that is ready at most once.  The task to run next is chosen
+// afresh each time, so a periodic task that falls due while a slow one is running goes
+// ahead of anything else still waiting.  Tasks with no period are only asked once a pass
+// whether they have anything to do.
+
 void RepRap::Spin()
 {
   if(!active)
     return;
     
-  platform->Spin();
-  move->Spin();
-  heat->Spin();
-  gcodes->Spin();
-  webserver->Spin();
+  unsigned long start = platform->Cycles();
+  int task;
+  for(task = 0; task < TASKS; task++)
+    taskPending[task] = taskPeriods[task] || HasWork(task);
+  
+  unsigned long now = platform->Time();
+  while((task = NextTask(now)) >= 0)
+  {
+    RunTask(task, now);
+    now = platform->Time();
+  }
+  
+  Record(LOOP_PROFILE, platform->Cycles() - start);
+  loops++;
+  if(now - loopCountStart >= 1000000)
+  {
+    loopsPerSecond = (unsigned long)((float)loops*1000000.0/(float)(now - loopCountStart));
+    loops = 0;
+    loopCountStart = now;
+  }
 }
 
+// The highest priority task that is ready to run; -1 if none is.
 
+int RepRap::NextTask(unsigned long now)
+{
+  int best = -1;
+  for(int i = 0; i < TASKS; i++)
+  {
+    if(!taskPending[i])
+      continue;
+    if(taskPeriods[i] && (long)(now - taskDue[i]) < 0)
+      continue;
+    if(best < 0 || taskPriorities[i] < taskPriorities[best])
+      best = i;
+  }
+  return best;
+}
 
-void RepRap::Interrupt()
+boolean RepRap::HasWork(int task)
 {
+  switch(task)
+  {
+  case GCODES_TASK:
+    return gcodes->HasWork();
+    
+  case WEB_TASK:
+    return webserver->HasWork();
+    
+  default:
+    return true;
+  }
+}
+
+// Periodic tasks are timed from when they were due rather than from when they ran, so
+// they don't drift; one that has got a whole period behind has missed its deadline, and
+// starts again from now.
+
+void RepRap::RunTask(int task, unsigned long now)
+{
+  taskPending[task] = false;
+  if(taskPeriods[task])
+  {
+    if(now - taskDue[task] >= taskPeriods[task])
+      taskMisses[task]++;
+    taskDue[task] += taskPeriods[task];
+    if((long)(now - taskDue[task]) >= 0)
+      taskDue[task] = now + taskPeriods[task];
+  }
   
+  unsigned long start = platform->Cycles();
+  switch(task)
+  {
+  case PLATFORM_TASK:
+    platform->Spin();
+    break;
+    
+  case MOVE_TASK:
+    move->Spin();
+    break;
+    
+  case HEAT_TASK:
+    heat->Spin();
+    break;
+    
+  case GCODES_TASK:
+    gcodes->Spin();
+    break;
+    
+  case WEB_TASK:
+    webserver->Spin();
+    break;
+  }
+  
+  unsigned long cycles = platform->Cycles() - start;
+  if(cycles > taskBudgets[task])
+    taskOverruns[task]++;
+  Record(task, cycles);
+}
+
+// Work down from the longest runs until more than 1% have been counted.  The answer is the
+// top of the bucket that happened in, or the longest run if that is less.
+
+unsigned long RepRap::Percentile99(int profile)
+{
+  unsigned long allowed = profileCounts[profile]/100;
+  unsigned long above = 0;
+  int b;
+  for(b = PROFILE_BUCKETS - 1; b > 0; b--)
+  {
+    above += profileHistograms[profile][b];
+    if(above > allowed)
+      break;
+  }
+  unsigned long cycles = (1ul << b) - 1;
+  if(cycles > profileLongest[profile])
+    cycles = profileLongest[profile];
+  return cycles/CYCLES_PER_MICROSECOND;
+}
+
+// Everything that's known about timing, to the host.  Bucket counts are for runs of
+// up to 1, 2, 4, 8... processor cycles.
+
+void RepRap::Diagnostics()
+{
+  // snprintf() returns what it would have written, so n is kept inside the string in case
+  // that was more than there was room for.
+
+  int i, j, n;
+  for(i = 0; i < PROFILES; i++)
+  {
+    n = snprintf(diagnosticString, PROFILE_STRING_LENGTH, "%s: runs %lu, longest %lu us, 99%% under %lu us", taskNames[i],
+      profileCounts[i], Longest(i), Percentile99(i));
+    if(n >= PROFILE_STRING_LENGTH)
+      n = PROFILE_STRING_LENGTH - 1;
+    if(i < TASKS)
+    {
+      n += snprintf(&diagnosticString[n], PROFILE_STRING_LENGTH - n, ", deadlines missed %lu, over budget %lu", taskMisses[i],
+        taskOverruns[i]);
+      if(n >= PROFILE_STRING_LENGTH)
+        n = PROFILE_STRING_LENGTH - 1;
+    }
+    n += snprintf(&diagnosticString[n], PROFILE_STRING_LENGTH - n, "<br>\nCycles:");
+    if(n >= PROFILE_STRING_LENGTH)
+      n = PROFILE_STRING_LENGTH - 1;
+    for(j = 0; j < PROFILE_BUCKETS && n < PROFILE_STRING_LENGTH - 1; j++)
+    {
+      n += snprintf(&diagnosticString[n], PROFILE_STRING_LENGTH - n, " %lu", profileHistograms[i][j]);
+      if(n >= PROFILE_STRING_LENGTH)
+        n = PROFILE_STRING_LENGTH - 1;
+    }
+    platform->Message(HOST_MESSAGE, diagnosticString);
+    platform->Message(HOST_MESSAGE, "<br>\n");
+  }
+  snprintf(diagnosticString, PROFILE_STRING_LENGTH, "Loops per second: %lu<br>\n", loopsPerSecond);
+  platform->Message(HOST_MESSAGE, diagnosticString);
+}
+
+
+
+void RepRap::Interrupt()
+{
+  unsigned long start = platform->Cycles();
+  move->Interrupt();
+  Record(INTERRUPT_PROFILE, platform->Cycles() - start);
 }
 
 
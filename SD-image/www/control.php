@@ -90,6 +90,13 @@
    
    <br><br><form name="input" action="control.php" method="get">Send a G Code: <input type="text" name="gcode"><input type="submit" value="Send"></form>
    
+   <br>G Codes queued/most queued/planner waits: <?php print(getQueueStatus()); ?>
+   <br>File sectors from RAM/bytes read per second: <?php print(getFileStatus()); ?>
+   <br>Messages dropped/last write/longest write (us): <?php print(getLogStatus()); ?>
+   <br><br>Longest/99% (us): <?php print(getTimingStatus()); ?>
+   
+   <br><br>Recent messages:<br><?php print(getRecentMessages()); ?>
+   
    <script language="javascript" type="text/javascript">
    
    
@@ -33,6 +33,8 @@
 <br><br>
 Click a file to delete it:
 <br>
+<?php print(getGCodePages()); ?>
+<br><br>
 <script language="javascript" type="text/javascript">
 function fileList()
 {
@@ -40,10 +42,17 @@ function fileList()
 	return files;
 }
 
+function fileLengths()
+{
+	var lengths = [<?php print(getGCodeLengths()); ?>];
+	return lengths;
+}
+
 
 function printGCodeTable()
 {
   var list = fileList();
+  var lengths = fileLengths();
 
   var count = list.length;
   
@@ -67,7 +76,7 @@ function printGCodeTable()
       result += "<td>&nbsp;<button type=\"button\" onclick=\"return deleteFile('";
       result += "gcodes/" + fileName; // Need PHP in here
       result += "')\">";
-      result += fileName;
+      result += fileName + "&nbsp;(" + Math.ceil(lengths[i*rows + j]/1024) + "k)";
       result += "</button>&nbsp;</td>";
       k++;
       if(k >= count)
@@ -38,6 +38,8 @@ Upload a G Code file :<br>
 
 <br><br>Click a file to print it:
 <br><br>
+<?php print(getGCodePages()); ?>
+<br><br>
 
 <script language="javascript" type="text/javascript">
 function fileList()
@@ -46,10 +48,17 @@ function fileList()
 	return files;
 }
 
+function fileLengths()
+{
+	var lengths = [<?php print(getGCodeLengths()); ?>];
+	return lengths;
+}
+
 
 function printGCodeTable()
 {
   var list = fileList();
+  var lengths = fileLengths();
 
   var count = list.length;
   
@@ -73,7 +82,7 @@ function printGCodeTable()
       result += "<td>&nbsp;<button type=\"button\" onclick=\"return printFile('";
       result += "gcodes/" + fileName; // Need PHP in here
       result += "')\">";
-      result += fileName;
+      result += fileName + "&nbsp;(" + Math.ceil(lengths[i*rows + j]/1024) + "k)";
       result += "</button>&nbsp;</td>";
       k++;
       if(k >= count)
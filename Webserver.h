@@ -16,6 +16,10 @@ It implements very very restricted PHP.  It can do:
 Note that by printing a function that returns "" you can just call 
 that function in this C++ code with no effect on the loaded web page.
 
+STATUS_PAGE isn't a file: it's a small JSON document of temperatures, positions, queues, the
+progress of the print and the latest messages, made in RAM and sent all at once, for programs
+that poll the machine.
+
 -----------------------------------------------------------------------------------------------------
 
 Version 0.1
@@ -33,23 +37,132 @@ Licence: GPL
 #ifndef WEBSERVER_H
 #define WEBSERVER_H
 
+// The functions a .php page can call.  The numbers are their places in the list of names.
+
+#define PHP_FUNCTION_NAMES { "gotPassword(", "printLinkTable(", "getMyName(", "getGCodeList(", "getQueueStatus(", "getFileStatus(", "logout(", \
+  "getRecentMessages(", "getLogStatus(", "getTimingStatus(", "getGCodeLengths(", "getGCodePages(" }
+#define PHP_FUNCTIONS 12
+#define GOT_PASSWORD 0
+#define PRINT_LINK_TABLE 1
+#define GET_MY_NAME 2
+#define GET_GCODE_LIST 3
+#define GET_QUEUE_STATUS 4
+#define GET_FILE_STATUS 5
+#define LOGOUT 6
+#define GET_RECENT_MESSAGES 7
+#define GET_LOG_STATUS 8
+#define GET_TIMING_STATUS 9
+#define GET_GCODE_LENGTHS 10
+#define GET_GCODE_PAGES 11
+
+// A .php page compiled into a list of operations: PHP_TEXT and PHP_ECHO send a span of
+// bytes from the file (start, length); PHP_IF calls the boolean function start and skips
+// the next length operations if it returns false; PHP_PRINT calls the string function start.
+// A page is compiled while it is interpreted the first time it is served, and is used
+// until the file changes.
+
+class PHPTemplate
+{
+  public:
+
+    PHPTemplate();
+
+    unsigned long nameHash;
+    unsigned long fileLength;
+    unsigned long fileChanges;
+    unsigned long lastUsed;
+    boolean valid;
+    int users; // Connections sending or compiling it
+    int opCount;
+    byte opType[PHP_OPS];
+    unsigned long opStart[PHP_OPS];
+    int opLength[PHP_OPS];
+};
+
+
+// Everything about one client's connection: the request being read, the upload being
+// received, and the file (and PHP) being sent.  The Webserver serves each connection in
+// turn, a bit at a time, so no client has to wait for another to finish.
+
+class HttpConnection
+{
+  public:
+  
+    HttpConnection();
+    
+    boolean open;
+    boolean keepAlive; // Stay connected for another request after this one
+    unsigned long lastActivity;
+    char inBuffer[WEB_SPIN_BYTES]; // Bytes read from the client and not yet dealt with
+    int inPointer;
+    int inLength;
+    
+    int fileBeingSent;
+    boolean writing;
+    boolean receivingPost;
+    char postBoundary[POST_LENGTH]; // The end of an upload is "\r\n--<boundary>--"
+    int boundaryLength;
+    byte boundaryFail[POST_LENGTH]; // For each prefix of the boundary, the longest shorter one that ends it
+    int boundaryCount; // Bytes matching the start of the boundary, held back from the file
+    unsigned long postBytes;
+    unsigned long postStart;
+    char postFileName[POST_LENGTH];
+    int postFile;
+    boolean postSeen;
+    boolean getSeen;
+    //long postLength;
+    boolean inPHPFile;
+    boolean clientLineIsBlank;
+    unsigned long clientCloseTime;
+    boolean needToCloseClient;
+
+    char clientLine[STRING_LENGTH];
+    char clientRequest[STRING_LENGTH];
+    char clientQualifier[STRING_LENGTH];
+    int listPage; // Which G Code files to list, from page= and sort= in the request
+    int listOrder;
+    int clientLinePointer;
+    char phpTag[PHP_TAG_LENGTH];
+    char phpRecord[PHP_TAG_LENGTH];
+    int inPHPString;
+    int phpPointer;
+    boolean phpEchoing;
+    boolean phpIfing;
+    boolean phpPrinting;
+    boolean eatInput;
+    boolean recordInput;
+    boolean ifWasTrue;
+    boolean sendTable;
+    char eatInputChar;
+    int phpRecordPointer;
+    unsigned long phpOffset; // Where in the file the byte being interpreted is
+    int phpTemplate; // The template being run or recorded; -1 for none
+    boolean recording;
+    boolean runningTemplate;
+    int phpIfOp; // The PHP_IF that echoed text depends on; -1 for none
+    int opIndex;
+    int spanDone;
+};
 
 class Webserver
 {   
   public:
   
-    Webserver(Platform* p);
-    boolean Available();
-    byte Read();
+    Webserver(Platform* p, CommandQueue* q);
     void Init();
     void Spin();
+    boolean HasWork(); // Any connections to look after?
     void Exit();
     
   private:
   
     void ParseClientLine();
     void SendFile(char* nameOfFileToSend);
-    void WriteByte();
+    void SendStatus();
+    void StatusString(char* s);
+    void StatusNumber(float f, int decimals);
+    void StatusText(char* s, int length); // Escaped for a JSON string
+    void WriteBytes();
     boolean StringEndsWith(char* string, char* ending);
     boolean StringStartsWith(char* string, char* starting);
     boolean StringEquals(char* s1, char* s2);
@@ -57,63 +170,63 @@ class Webserver
     void CheckPassword();
     boolean LoadGcodeBuffer(char* gc, boolean convertWeb);
     void CloseClient();
+    void InitialiseConnection();
+    void AbandonConnection();
+    void SpinConnection();
+    void ReleaseTemplate();
     void InitialisePHP();
     char PHPParse(char* phpString);
     boolean PrintHeadString();
     boolean PrintLinkTable();
     void GetGCodeList();
-    boolean CallPHPBoolean(char* phpRecord);
-    void CallPHPString(char* phpRecord);  
+    void GetQueueStatus();
+    void GetFileStatus();
+    void GetLogStatus();
+    void GetTimingStatus();
+    void GetGCodePages();
+    int PHPFunction(char* phpRecord);
+    boolean CallPHPBoolean(int function);
+    void CallPHPString(int function);  
     void ProcessPHPByte(char b);
-    void WritePHPByte();
+    void PHPText(char* s, int length, boolean echo);
+    void RecordOp(byte type, unsigned long start, int length);
+    void FindTemplate(char* fileName);
+    void RunTemplate();
+    void WritePHPBytes();
     void ParseGetPost();
     void CharFromClient(char c);
     void BlankLineFromClient();
     void InitialisePost();
     int StringContains(char* string, char* match);
-    boolean MatchBoundary(char c);
+    void SetBoundary(char* b);
+    int Upload(char* b, int length);
+    boolean Uploading();
     
     Platform* platform;
+    CommandQueue* queue;
     boolean active;
     unsigned long lastTime;
-    int fileBeingSent;
-    boolean writing;
-    boolean receivingPost;
-    char postBoundary[POST_LENGTH];
-    int boundaryCount;  
-    char postFileName[POST_LENGTH];
-    int postFile;
-    boolean postSeen;
-    boolean getSeen;
-    //long postLength;
-    boolean inPHPFile;
-    boolean clientLineIsBlank;
-    unsigned long clientCloseTime;
-    boolean needToCloseClient;
-
-    char clientLine[STRING_LENGTH];
-    char clientRequest[STRING_LENGTH];
-    char clientQualifier[STRING_LENGTH];
+    HttpConnection connections[HTTP_CONNECTIONS];
+    HttpConnection* conn; // The connection being serviced
+    char sendBuffer[WEB_SPIN_BYTES];
+    char uploadBuffer[UPLOAD_SPIN_BYTES];
+    GCodeSidecar sidecar; // The index of the file being uploaded...
+    HttpConnection* sidecarConnection; // ...by this connection; 0 if none
     char gcodeBuffer[GCODE_LENGTH];
-    boolean gcodeAvailable;
     int gcodePointer;
-    int clientLinePointer;
+    char statusString[STATUS_LENGTH];
+    char statusJson[STATUS_JSON_LENGTH];
+    int statusPointer;
+    char logTail[STATUS_LOG_LENGTH];
     boolean gotPassword;
     char* password;
     char* myName;
-    char phpTag[PHP_TAG_LENGTH];
-    char phpRecord[PHP_TAG_LENGTH];
-    int inPHPString;
-    int phpPointer;
-    boolean phpEchoing;
-    boolean phpIfing;
-    boolean phpPrinting;
-    boolean eatInput;
-    boolean recordInput;
-    boolean ifWasTrue;
-    boolean sendTable;
-    char eatInputChar;
-    int phpRecordPointer;
+    
+    char* phpFunctionNames[PHP_FUNCTIONS];
+    unsigned long phpFunctionHashes[PHP_FUNCTIONS];
+    int phpDispatch[PHP_DISPATCH]; // Function numbers by hash of name; -1 for empty
+    PHPTemplate templates[PHP_TEMPLATES];
+    unsigned long templateClock;
 };
 
 
@@ -93,58 +93,104 @@ int Webserver::StringContains(char* string, char* match)
   return -1;
 }
 
-boolean Webserver::MatchBoundary(char c)
+// Set up the string that marks the end of an upload, and its Knuth-Morris-Pratt table,
+// so it can be found however it is split between reads and whatever the file holds.
+
+void Webserver::SetBoundary(char* b)
 {
-  if(!postBoundary[0])
-    return false;
-    
-  if(c == postBoundary[boundaryCount])
-  {
-    boundaryCount++;
-    if(!postBoundary[boundaryCount])
-    {
-      boundaryCount = 0;
-      return true;
-    }
-  } else
+  strcpy(conn->postBoundary, "\r\n--");
+  strcat(conn->postBoundary, b);
+  strcat(conn->postBoundary, "--");
+  conn->boundaryLength = strlen(conn->postBoundary);
+  conn->boundaryFail[0] = 0;
+  int k = 0;
+  for(int i = 1; i < conn->boundaryLength; i++)
   {
-    for(int i = 0; i < boundaryCount; i++)
-      platform->Write(postFile, postBoundary[i]);
-    platform->Write(postFile, c);
-    boundaryCount = 0;
+    while(k > 0 && conn->postBoundary[i] != conn->postBoundary[k])
+      k = conn->boundaryFail[k - 1];
+    if(conn->postBoundary[i] == conn->postBoundary[k])
+      k++;
+    conn->boundaryFail[i] = k;
   }
-  return false;  
 }
 
-
-//****************************************************************************************************
-
-// Handling G Codes for the rest of the software
-
-boolean Webserver::Available()
+boolean Webserver::Uploading()
 {
-  return gcodeAvailable;
+  return conn->receivingPost && conn->postFile >= 0;
 }
 
-byte Webserver::Read()
+// Search length bytes from the client for the end of the upload, and write everything
+// before it to the file in one go.  Bytes that might be the start of the boundary are
+// held back; they are known to be the start of the boundary, so aren't kept.  Returns the
+// number of bytes used, which is all of them unless the end was found.
+
+int Webserver::Upload(char* b, int length)
 {
-  byte c = gcodeBuffer[gcodePointer];
-  if(!c)
+  char* p = conn->postBoundary;
+  int held = conn->boundaryCount;
+  int q = held;
+  int i = 0;
+  boolean found = false;
+  while(i < length)
+  {
+    char c = b[i++];
+    while(q > 0 && p[q] != c)
+      q = conn->boundaryFail[q - 1];
+    if(p[q] == c)
+      q++;
+    if(q >= conn->boundaryLength)
+    {
+      found = true;
+      break;
+    }
+  }
+  
+  int data = held + i - q;
+  if(data > 0)
+  {
+    platform->Write(conn->postFile, p, data < held ? data : held);
+    if(sidecarConnection == conn)
+      sidecar.Scan(p, data < held ? data : held);
+  }
+  if(data > held)
   {
-     gcodeAvailable = false;
-     gcodePointer = 0;
-     gcodeBuffer[gcodePointer] = 0;
+    platform->Write(conn->postFile, b, data - held);
+    if(sidecarConnection == conn)
+      sidecar.Scan(b, data - held);
+  }
+  conn->postBytes += data;
+  conn->boundaryCount = q;
+  if(!found)
+    return i;
+    
+  platform->Close(conn->postFile);
+  platform->IndexGCode(conn->postFileName, conn->postBytes);
+  if(sidecarConnection == conn)
+  {
+    sidecar.Save(conn->postFileName);
+    sidecarConnection = 0;
   } else
-    gcodePointer++;
-  return c;
+    sidecar.Remove(conn->postFileName); // Any old one is out of date
+  unsigned long t = platform->Time() - conn->postStart;
+  snprintf(statusString, STATUS_LENGTH, "Uploaded %lu bytes at %lu bytes/s.<br>\n", conn->postBytes,
+    (unsigned long)((float)conn->postBytes*1000000.0/(float)(t ? t : 1)));
+  platform->Message(HOST_MESSAGE, statusString);
+  SendFile(conn->clientRequest);
+  conn->clientRequest[0] = 0;
+  InitialisePost();
+  return i;
 }
 
 
+//****************************************************************************************************
+
+// Handling G Codes for the rest of the software
+
+// A web request can hold several lines of G Code; they all go on the command queue
+// or none of them do.
+
 boolean Webserver::LoadGcodeBuffer(char* gc, boolean convertWeb)
 {
-  if(gcodeAvailable)
-    return false;
-  
   if(strlen(gc) > GCODE_LENGTH-1)
   {
     platform->Message(HOST_MESSAGE, "Webserver: GCode buffer overflow.<br>\n");
@@ -198,16 +244,38 @@ boolean Webserver::LoadGcodeBuffer(char* gc, boolean convertWeb)
       platform->Message(HOST_MESSAGE, "Unsuccsessful attempt to delete: ");
       platform->Message(HOST_MESSAGE, &gcodeBuffer[4]);
       platform->Message(HOST_MESSAGE, "<br>\n");
+    } else
+    {
+      platform->UnindexGCode(&gcodeBuffer[4]);
+      sidecar.Remove(&gcodeBuffer[4]);
     }
     gcodePointer = 0;
     gcodeBuffer[gcodePointer] = 0;
-    gcodeAvailable = false;
     return true;
   }
 
 // Otherwise, send them to the G Code interpreter
 
-  gcodeAvailable = true;
+  int lines = 1;
+  for(gcodePointer = 0; gcodeBuffer[gcodePointer]; gcodePointer++)
+    if(gcodeBuffer[gcodePointer] == '\n')
+      lines++;
+  if(queue->Space(WEB_SOURCE) < lines)
+    return false;
+    
+  char* line = gcodeBuffer;
+  for(gcodePointer = 0; gcodeBuffer[gcodePointer]; gcodePointer++)
+  {
+    if(gcodeBuffer[gcodePointer] == '\n')
+    {
+      gcodeBuffer[gcodePointer] = 0;
+      queue->Put(line, WEB_SOURCE, NO_FILE_OFFSET);
+      line = &gcodeBuffer[gcodePointer + 1];
+    }
+  }
+  queue->Put(line, WEB_SOURCE, NO_FILE_OFFSET);
+  gcodePointer = 0;
+  gcodeBuffer[gcodePointer] = 0;
   return true;
 }
 
@@ -219,13 +287,28 @@ boolean Webserver::LoadGcodeBuffer(char* gc, boolean convertWeb)
 
 // Output to the client
 
+// The reply is finished.  If the client wants to keep the connection for another request,
+// get ready for it; otherwise close it.
+
 void Webserver::CloseClient()
 {
-  writing = false;
-  inPHPFile = false;
+  conn->writing = false;
+  conn->inPHPFile = false;
   InitialisePHP();
-  clientCloseTime = platform->Time();
-  needToCloseClient = true;   
+  ReleaseTemplate();
+  platform->EndClientOutput();
+  if(conn->keepAlive)
+  {
+    conn->clientLineIsBlank = true;
+    conn->clientLinePointer = 0;
+    conn->clientRequest[0] = 0;
+    conn->clientQualifier[0] = 0;
+    conn->getSeen = false;
+    conn->lastActivity = platform->Time();
+    return;
+  }
+  conn->clientCloseTime = platform->Time();
+  conn->needToCloseClient = true;   
 }
 
 
@@ -236,19 +319,58 @@ void Webserver::SendFile(char* nameOfFileToSend)
   
   if(!gotPassword)
   {
-    sendTable = false;
+    conn->sendTable = false;
     nameOfFileToSend = PASSWORD_PAGE;
   } else
-    sendTable = true;
+    conn->sendTable = true;
     
+//  if(InternalFile(nameOfFileToSend))
+//    return;
+
+  if(StringEquals(nameOfFileToSend, STATUS_PAGE))
+  {
+    SendStatus();
+    return;
+  }
+  
+  //Serial.print("File requested: ");
+  //Serial.println(nameOfFileToSend);
+  
+  conn->fileBeingSent = platform->OpenFile(platform->PrependRoot(platform->GetWebDir(), nameOfFileToSend), false);
+  if(conn->fileBeingSent < 0)
+  {
+    conn->sendTable = false;
+    nameOfFileToSend = "html404.htm";
+    conn->fileBeingSent = platform->OpenFile(platform->PrependRoot(platform->GetWebDir(), nameOfFileToSend), false);
+    if(conn->fileBeingSent < 0)
+    {
+      conn->keepAlive = false;
+      CloseClient();
+      return;
+    }
+  }
+  
+  conn->inPHPFile = StringEndsWith(nameOfFileToSend, ".php");
+  
   platform->SendToClient("HTTP/1.1 200 OK\n");
   
   if(StringEndsWith(nameOfFileToSend, ".png"))
     platform->SendToClient("Content-Type: image/png\n");
   else
     platform->SendToClient("Content-Type: text/html\n");
+  
+  // A kept-alive connection needs to know where the reply ends.  The length of a .php
+  // page isn't known until it has been sent, so that goes in chunks.
     
-  platform->SendToClient("Connnection: close\n");
+  if(!conn->keepAlive)
+    platform->SendToClient("Connection: close\n");
+  else if(conn->inPHPFile)
+    platform->SendToClient("Connection: keep-alive\nTransfer-Encoding: chunked\n");
+  else
+  {
+    snprintf(statusString, STATUS_LENGTH, "Connection: keep-alive\nContent-Length: %lu\n", platform->Length(conn->fileBeingSent));
+    platform->SendToClient(statusString);
+  }
   
 //          if(loadingImage)
 //          {
@@ -258,34 +380,143 @@ void Webserver::SendFile(char* nameOfFileToSend)
 
   platform->SendToClient('\n');
   
-//  if(InternalFile(nameOfFileToSend))
-//    return;
-  
-  //Serial.print("File requested: ");
-  //Serial.println(nameOfFileToSend);
-  
-  fileBeingSent = platform->OpenFile(platform->PrependRoot(platform->GetWebDir(), nameOfFileToSend), false);
-  if(fileBeingSent < 0)
+  if(conn->inPHPFile)
   {
-    sendTable = false;
-    nameOfFileToSend = "html404.htm";
-    fileBeingSent = platform->OpenFile(platform->PrependRoot(platform->GetWebDir(), nameOfFileToSend), false);
-  }
-  
-  inPHPFile = StringEndsWith(nameOfFileToSend, ".php");
-  if(inPHPFile)
+    if(conn->keepAlive)
+      platform->ChunkClientOutput();
     InitialisePHP();
-  writing = true; 
+    FindTemplate(platform->PrependRoot(platform->GetWebDir(), nameOfFileToSend));
+  }
+  conn->writing = true; 
 }
 
-void Webserver::WriteByte()
+// The whole of STATUS_PAGE is made before any of it is sent, so its length is known and
+// it goes in the same pass as the end of the request.  It looks like:
+//
+// {"temps":[bed,heads...],"targets":[...],"pos":[x,y,z,e...],"queue":[gcodes,moves],
+//  "job":{"printing":false,"offset":0,"length":0,"layer":1,"layers":60},"log":"..."}
+//
+// Positions are where the last queued move will finish.  "job" is {} if no file is selected,
+// and has the layers only if the file has a sidecar index.
+
+void Webserver::SendStatus()
 {
-    unsigned char b;
-    if(platform->Read(fileBeingSent, b))
-      platform->SendToClient(b);
-    else
+  Heat* heat = reprap.GetHeat();
+  Move* move = reprap.GetMove();
+  PrintJob* job = reprap.GetGCodes()->GetPrintJob();
+  float position[DRIVES];
+  int i;
+
+  statusPointer = 0;
+  StatusString("{\"temps\":[");
+  for(i = 0; i < HEATERS; i++)
+  {
+    if(i)
+      StatusString(",");
+    StatusNumber(heat->GetTemperature(i), 1);
+  }
+  StatusString("],\"targets\":[");
+  for(i = 0; i < HEATERS; i++)
+  {
+    if(i)
+      StatusString(",");
+    StatusNumber(heat->GetTarget(i), 1);
+  }
+  StatusString("],\"pos\":[");
+  move->GetLastPosition(position);
+  for(i = 0; i < DRIVES; i++)
+  {
+    if(i)
+      StatusString(",");
+    StatusNumber(position[i], 3);
+  }
+  snprintf(statusString, STATUS_LENGTH, "],\"queue\":[%d,%d],\"job\":{", queue->Depth(), move->QueueDepth());
+  StatusString(statusString);
+  if(job->Selected())
+  {
+    snprintf(statusString, STATUS_LENGTH, "\"printing\":%s,\"offset\":%lu,\"length\":%lu", job->Printing() ? "true" : "false",
+      reprap.GetGCodes()->PrintedOffset(), job->Length());
+    StatusString(statusString);
+    GCodeSidecar* sidecar = job->Sidecar();
+    if(sidecar->Loaded())
+    {
+      snprintf(statusString, STATUS_LENGTH, ",\"layer\":%ld,\"layers\":%ld", sidecar->LayerAt(reprap.GetGCodes()->PrintedOffset()) + 1, sidecar->Layers());
+      StatusString(statusString);
+    }
+  }
+  StatusString("},\"log\":\"");
+  StatusText(logTail, platform->LogTail(logTail, STATUS_LOG_LENGTH));
+  StatusString("\"}");
+
+  platform->SendToClient("HTTP/1.1 200 OK\nContent-Type: application/json\nCache-Control: no-cache\n");
+  if(!conn->keepAlive)
+    platform->SendToClient("Connection: close\n");
+  else
+  {
+    snprintf(statusString, STATUS_LENGTH, "Connection: keep-alive\nContent-Length: %d\n", statusPointer);
+    platform->SendToClient(statusString);
+  }
+  platform->SendToClient('\n');
+  platform->SendToClient(statusJson, statusPointer);
+  CloseClient();
+}
+
+void Webserver::StatusString(char* s)
+{
+  while(*s && statusPointer < STATUS_JSON_LENGTH)
+    statusJson[statusPointer++] = *s++;
+}
+
+// No printf of floats here, so whole numbers of the last decimal place
+
+void Webserver::StatusNumber(float f, int decimals)
+{
+  long scale = 1;
+  for(int i = 0; i < decimals; i++)
+    scale *= 10;
+  long n = (long)floor(f*scale + 0.5);
+  char* sign = "";
+  if(n < 0)
+  {
+    sign = "-";
+    n = -n;
+  }
+  snprintf(statusString, STATUS_LENGTH, "%s%ld.%0*ld", sign, n/scale, decimals, n%scale);
+  StatusString(statusString);
+}
+
+// Quotes and backslashes are escaped, newlines become \n and any other control characters are dropped
+
+void Webserver::StatusText(char* s, int length)
+{
+  char c;
+  for(int i = 0; i < length && statusPointer < STATUS_JSON_LENGTH - 2; i++)
+  {
+    c = s[i];
+    if(c == '"' || c == '\\')
+    {
+      statusJson[statusPointer++] = '\\';
+      statusJson[statusPointer++] = c;
+    } else if(c == '\n')
+    {
+      statusJson[statusPointer++] = '\\';
+      statusJson[statusPointer++] = 'n';
+    } else if((unsigned char)c >= ' ')
+      statusJson[statusPointer++] = c;
+  }
+}
+
+// Send the next piece of the file.  At most WEB_SPIN_BYTES are read each time round the
+// main loop, so serving a page never holds up everything else for long.
+
+void Webserver::WriteBytes()
+{
+    int n = platform->Read(conn->fileBeingSent, sendBuffer, WEB_SPIN_BYTES);
+    if(n > 0)
+      platform->SendToClient(sendBuffer, n);
+    if(n < WEB_SPIN_BYTES)
     { 
-      platform->Close(fileBeingSent);    
+      platform->Close(conn->fileBeingSent);    
       CloseClient(); 
     }  
 }
@@ -296,11 +527,11 @@ void Webserver::WriteByte()
 
 void Webserver::CheckPassword()
 {
-  if(!StringEndsWith(clientQualifier, password))
+  if(!StringEndsWith(conn->clientQualifier, password))
     return;
     
   gotPassword = true;
-  strcpy(clientRequest, INDEX_PAGE);
+  strcpy(conn->clientRequest, INDEX_PAGE);
 }
 
 /*
@@ -324,108 +555,124 @@ void Webserver::ParseGetPost()
 //    Serial.print("HTTP request: ");
 //    Serial.println(clientLine);
   
-    platform->Message(HOST_MESSAGE, "HTTP request: ");
-    platform->Message(HOST_MESSAGE, clientLine);
-    platform->Message(HOST_MESSAGE, "<br>\n");
-    
     int i = 5;
     int j = 0;
-    clientRequest[j] = 0;
-    clientQualifier[0] = 0;
-    while(clientLine[i] != ' ' && clientLine[i] != '?')
+    conn->clientRequest[j] = 0;
+    conn->clientQualifier[0] = 0;
+    conn->listPage = 0;
+    conn->listOrder = SORT_BY_NAME;
+    while(conn->clientLine[i] != ' ' && conn->clientLine[i] != '?')
     {
-      clientRequest[j] = clientLine[i];
+      conn->clientRequest[j] = conn->clientLine[i];
       j++;
       i++;
     }
-    clientRequest[j] = 0;
-    if(clientLine[i] == '?')
+    conn->clientRequest[j] = 0;
+    if(conn->clientLine[i] == '?')
     {
       i++;
       j = 0;
-      while(clientLine[i] != ' ')
+      while(conn->clientLine[i] != ' ')
       {
-        clientQualifier[j] = clientLine[i];
+        conn->clientQualifier[j] = conn->clientLine[i];
         j++;
         i++;      
       }
-      clientQualifier[j] = 0;
+      conn->clientQualifier[j] = 0;
     } 
+    
+    // Polls for the status would fill the log (and the SD card) with themselves
+    
+    if(StringEquals(conn->clientRequest, STATUS_PAGE))
+      return;
+    platform->Message(HOST_MESSAGE, "HTTP request: ");
+    platform->Message(HOST_MESSAGE, conn->clientLine);
+    platform->Message(HOST_MESSAGE, "<br>\n");
 }
 
 void Webserver::InitialisePost()
 {
-  postSeen = false;
-  receivingPost = false;
-  boundaryCount = 0; 
-  postBoundary[0] = 0;
-  postFileName[0] = 0;
-  postFile = -1;
+  conn->postSeen = false;
+  conn->receivingPost = false;
+  conn->boundaryCount = 0; 
+  conn->postBoundary[0] = 0;
+  conn->postFileName[0] = 0;
+  conn->postFile = -1;
 }
 
 void Webserver::ParseClientLine()
 { 
-  if(StringStartsWith(clientLine, "GET"))
+  if(StringStartsWith(conn->clientLine, "GET"))
   {
     ParseGetPost();
-    postSeen = false;
-    getSeen = true;
-    if(!clientRequest[0])
-      strcpy(clientRequest, INDEX_PAGE);
+    conn->keepAlive = StringContains(conn->clientLine, "HTTP/1.1") >= 0;
+    conn->postSeen = false;
+    conn->getSeen = true;
+    if(!conn->clientRequest[0])
+      strcpy(conn->clientRequest, INDEX_PAGE);
 //    Serial.println(MESSAGE_FILE);
 //    Serial.println(clientRequest);
 //   Serial.println(gettingMessages);
     return;
   }
   
-  if(StringStartsWith(clientLine, "POST"))
+  if(StringStartsWith(conn->clientLine, "POST"))
   {
     ParseGetPost();
+    conn->keepAlive = StringContains(conn->clientLine, "HTTP/1.1") >= 0;
     InitialisePost();
-    postSeen = true;
-    getSeen = false;
-    if(!clientRequest[0])
-      strcpy(clientRequest, PRINT_PAGE);
+    conn->postSeen = true;
+    conn->getSeen = false;
+    if(!conn->clientRequest[0])
+      strcpy(conn->clientRequest, PRINT_PAGE);
+    return;
+  }
+  
+  // HTTP/1.1 clients keep the connection unless they say otherwise; 1.0 ones only if they ask
+  
+  if(StringStartsWith(conn->clientLine, "Connection:"))
+  {
+    if(StringContains(conn->clientLine, "close") >= 0 || StringContains(conn->clientLine, "Close") >= 0)
+      conn->keepAlive = false;
+    else if(StringContains(conn->clientLine, "keep-alive") >= 0 || StringContains(conn->clientLine, "Keep-Alive") >= 0)
+      conn->keepAlive = true;
     return;
   }
   
   int bnd;
   
-  if(postSeen && ( (bnd = StringContains(clientLine, "boundary=")) >= 0) )
+  if(conn->postSeen && ( (bnd = StringContains(conn->clientLine, "boundary=")) >= 0) )
   {
-    if(strlen(&clientLine[bnd]) >= POST_LENGTH - 4)
+    if(strlen(&conn->clientLine[bnd]) >= POST_LENGTH - 6)
     {
       platform->Message(HOST_MESSAGE, "Post boundary buffer overflow.<br>\n");
       return;
     }
-    postBoundary[0] = '-';
-    postBoundary[1] = '-';
-    strcpy(&postBoundary[2], &clientLine[bnd]);
-    strcat(postBoundary, "--");
+    SetBoundary(&conn->clientLine[bnd]);
     //Serial.print("Got boundary: ");
     //Serial.println(postBoundary);
     return;
   }
   
-  if(receivingPost && StringStartsWith(clientLine, "Content-Disposition:"))
+  if(conn->receivingPost && StringStartsWith(conn->clientLine, "Content-Disposition:"))
   {
-    bnd = StringContains(clientLine, "filename=\"");
+    bnd = StringContains(conn->clientLine, "filename=\"");
     if(bnd < 0)
     {
       platform->Message(HOST_MESSAGE, "Post disposition gives no filename.<br>\n");
       return;
     }
     int i = 0;
-    while(clientLine[bnd] && clientLine[bnd] != '"')
+    while(conn->clientLine[bnd] && conn->clientLine[bnd] != '"')
     {
-      postFileName[i++] = clientLine[bnd++];
+      conn->postFileName[i++] = conn->clientLine[bnd++];
       if(i >= POST_LENGTH)
       {
         i = 0;
         platform->Message(HOST_MESSAGE, "Post filename buffer overflow.<br>\n");
       }
     }
-    postFileName[i] = 0;
+    conn->postFileName[i] = 0;
     //Serial.print("Got file name: ");
     //Serial.println(postFileName);    
     return;
@@ -435,20 +682,27 @@ void Webserver::ParseClientLine()
 
 void Webserver::ParseQualifier()
 {
-  if(!clientQualifier[0])
+  if(!conn->clientQualifier[0])
     return;
     
-  if(StringStartsWith(clientQualifier, "pwd="))
+  if(StringStartsWith(conn->clientQualifier, "pwd="))
     CheckPassword();
   if(!gotPassword) //Doan work fur nuffink
     return;
     
-  if(StringStartsWith(clientQualifier, "gcode="))
+  if(StringStartsWith(conn->clientQualifier, "gcode="))
   {
-    if(!LoadGcodeBuffer(&clientQualifier[6], true))
+    if(!LoadGcodeBuffer(&conn->clientQualifier[6], true))
       platform->Message(HOST_MESSAGE, "Webserver: buffer not free!<br>\n");
     //strcpy(clientRequest, INDEX_PAGE);
+    return;
   } 
+  
+  int i;
+  if((i = StringContains(conn->clientQualifier, "page=")) >= 0)
+    conn->listPage = atoi(&conn->clientQualifier[i]);
+  if((i = StringContains(conn->clientQualifier, "sort=")) >= 0)
+    conn->listOrder = atoi(&conn->clientQualifier[i]);
 }
 
 // if you've gotten to the end of the line (received a newline
@@ -456,35 +710,43 @@ void Webserver::ParseQualifier()
 // so you can send a reply
 void Webserver::BlankLineFromClient()
 {
-  clientLine[clientLinePointer] = 0;
-  clientLinePointer = 0;
+  conn->clientLine[conn->clientLinePointer] = 0;
+  conn->clientLinePointer = 0;
   ParseQualifier();
   
   //Serial.println("End of header.");
   
-  if(getSeen)
+  if(conn->getSeen)
   {
-   SendFile(clientRequest);
-   clientRequest[0] = 0;
+   SendFile(conn->clientRequest);
+   conn->clientRequest[0] = 0;
    return;
   }
   
-  if(postSeen)
+  if(conn->postSeen)
   {
-    receivingPost = true;
-    postSeen = false;
+    conn->receivingPost = true;
+    conn->postSeen = false;
     return;
   }
   
-  if(receivingPost)
+  if(conn->receivingPost)
   {
-    postFile = platform->OpenFile(platform->PrependRoot(platform->GetGcodeDir(), postFileName), true);
-    if(postFile < 0  || !postBoundary[0])
+    conn->postFile = platform->OpenFile(platform->PrependRoot(platform->GetGcodeDir(), conn->postFileName), true);
+    if(conn->postFile < 0  || !conn->postBoundary[0])
     {
       platform->Message(HOST_MESSAGE, "Can't open file for write or no post boundary: ");
-      platform->Message(HOST_MESSAGE, platform->PrependRoot(platform->GetGcodeDir(), postFileName));
+      platform->Message(HOST_MESSAGE, platform->PrependRoot(platform->GetGcodeDir(), conn->postFileName));
       platform->Message(HOST_MESSAGE, "<br>\n");
       InitialisePost();
+      return;
+    }
+    conn->postBytes = 0;
+    conn->postStart = platform->Time();
+    if(!sidecarConnection)
+    {
+      sidecarConnection = conn;
+      sidecar.Start();
     }
   }  
 
@@ -493,7 +755,7 @@ void Webserver::BlankLineFromClient()
 
 void Webserver::CharFromClient(char c)
 {
-  if(c == '\n' && clientLineIsBlank) 
+  if(c == '\n' && conn->clientLineIsBlank) 
   {
     BlankLineFromClient();
     return;
@@ -501,75 +763,150 @@ void Webserver::CharFromClient(char c)
   
   if(c == '\n') 
   {
-    clientLine[clientLinePointer] = 0;
+    conn->clientLine[conn->clientLinePointer] = 0;
     ParseClientLine();
     // you're starting a new line
-    clientLineIsBlank = true;
-    clientLinePointer = 0;
+    conn->clientLineIsBlank = true;
+    conn->clientLinePointer = 0;
   } else if(c != '\r') 
   {
     // you've gotten a character on the current line
-    clientLineIsBlank = false;
-    clientLine[clientLinePointer] = c;
-    clientLinePointer++;
-    if(clientLinePointer >= STRING_LENGTH)
+    conn->clientLineIsBlank = false;
+    conn->clientLine[conn->clientLinePointer] = c;
+    conn->clientLinePointer++;
+    if(conn->clientLinePointer >= STRING_LENGTH)
     {
       platform->Message(HOST_MESSAGE,"Client read buffer overflow.<br>\n");
-      clientLinePointer = 0;
-      clientLine[clientLinePointer] = 0; 
+      conn->clientLinePointer = 0;
+      conn->clientLine[conn->clientLinePointer] = 0; 
     }
   }  
 }
 
-// Deal with input/output from/to the client (if any) one byte at a time.
+// Deal with input/output from/to the clients (if any).  Each connection gets a turn, in
+// which it sends or takes in at most WEB_SPIN_BYTES.
 
 void Webserver::Spin()
 {
   if(!active)
     return;
     
-  if(writing)
+  for(int i = 0; i < HTTP_CONNECTIONS; i++)
+  {
+    conn = &connections[i];
+    platform->SelectClient(i);
+    SpinConnection();
+  }
+}
+
+boolean Webserver::HasWork()
+{
+  if(!active)
+    return false;
+  for(int i = 0; i < HTTP_CONNECTIONS; i++)
+  {
+    platform->SelectClient(i);
+    if(connections[i].open || (platform->ClientStatus() & CLIENT))
+      return true;
+  }
+  return false;
+}
+
+void Webserver::SpinConnection()
+{
+  int status = platform->ClientStatus();
+  if(!(status & CLIENT))
+  {
+    if(conn->open)
+      AbandonConnection();
+    return;
+  }
+  if(!conn->open)
   {
-    if(inPHPFile)
-      WritePHPByte();
+    InitialiseConnection();
+    conn->open = true;
+  }
+  
+  if(conn->writing)
+  {
+    if(!(status & CONNECTED))
+    {
+      AbandonConnection();
+      platform->DisconnectClient();
+      return;
+    }
+    if(conn->inPHPFile)
+      WritePHPBytes();
     else
-      WriteByte();
+      WriteBytes();
     return;         
   }
   
-  if(platform->ClientStatus() & CONNECTED)
+  if(conn->needToCloseClient)
+  {
+    if(platform->Time() - conn->clientCloseTime < CLIENT_CLOSE_DELAY)
+      return;
+    platform->DisconnectClient();
+    InitialiseConnection();
+    return;
+  }
+  
+  if(conn->inPointer >= conn->inLength)
   {
-    if(platform->ClientStatus() & AVAILABLE) 
+    conn->inPointer = 0;
+    conn->inLength = 0;
+    if(status & AVAILABLE)
     {
-      char c = platform->ClientRead();
-      //Serial.write(c); 
- 
-      if(receivingPost && postFile >= 0)
+      if(!Uploading())
+        conn->inLength = platform->ClientRead(conn->inBuffer, WEB_SPIN_BYTES);
+      else
       {
-        if(MatchBoundary(c))
+        // Uploads are taken in big pieces.  Anything after the end is the next request.
+        
+        conn->lastActivity = platform->Time();
+        int n = platform->ClientRead(uploadBuffer, UPLOAD_SPIN_BYTES);
+        int used = Upload(uploadBuffer, n);
+        n -= used;
+        if(n > WEB_SPIN_BYTES)
+        {
+          platform->Message(HOST_MESSAGE, "Webserver: input after upload lost.<br>\n", LOG_WARNING);
+          n = WEB_SPIN_BYTES;
+        }
+        if(n > 0)
         {
-          //Serial.println("Got to end of file.");
-          platform->Close(postFile);
-          SendFile(clientRequest);
-          clientRequest[0] = 0;
-          InitialisePost();       
+          memcpy(conn->inBuffer, &uploadBuffer[used], n);
+          conn->inLength = n;
         }
         return;
-      }  
-      
-      CharFromClient(c);
+      }
     }
-  }  
-   
-  if (platform->ClientStatus() & CLIENT) 
+  }
+  
+  // Anything left over when a reply starts is the start of the next request, and waits
+  // until the reply is finished.
+  
+  if(conn->inPointer < conn->inLength)
   {
-    if(needToCloseClient)
+    conn->lastActivity = platform->Time();
+    while(conn->inPointer < conn->inLength && !conn->writing && !conn->needToCloseClient)
     {
-      if(platform->Time() - clientCloseTime < CLIENT_CLOSE_DELAY)
-        return;
-      needToCloseClient = false;  
-      platform->DisconnectClient();
-    }   
+      if(Uploading())
+      {
+        conn->inPointer += Upload(&conn->inBuffer[conn->inPointer], conn->inLength - conn->inPointer);
+        continue;
+      }
+      
+      CharFromClient(conn->inBuffer[conn->inPointer++]);
+    }
+    return;
+  }
+  
+  // Nothing to do - close the connection if the client has, or if it has been idle too long
+  
+  if(!(status & CONNECTED) || platform->Time() - conn->lastActivity > KEEP_ALIVE_TIMEOUT)
+  {
+    AbandonConnection();
+    platform->DisconnectClient();
   }
 }
 
@@ -579,17 +916,17 @@ void Webserver::Spin()
 
 void Webserver::InitialisePHP()
 {
-  phpTag[0] = 0;
-  inPHPString = 0;
-  phpPointer = 0;
-  phpEchoing = false;
-  phpIfing = false;
-  phpPrinting = false;
-  eatInput = false;
-  recordInput = false;
-  phpRecordPointer = 0;
-  phpRecord[phpRecordPointer] = 0;
-  ifWasTrue = true;
+  conn->phpTag[0] = 0;
+  conn->inPHPString = 0;
+  conn->phpPointer = 0;
+  conn->phpEchoing = false;
+  conn->phpIfing = false;
+  conn->phpPrinting = false;
+  conn->eatInput = false;
+  conn->recordInput = false;
+  conn->phpRecordPointer = 0;
+  conn->phpRecord[conn->phpRecordPointer] = 0;
+  conn->ifWasTrue = true;
 }
 
 char Webserver::PHPParse(char* phpString)
@@ -607,161 +944,442 @@ char Webserver::PHPParse(char* phpString)
 }
 
 
-boolean Webserver::PrintLinkTable() { boolean r = sendTable; sendTable = true; return r; }
+boolean Webserver::PrintLinkTable() { boolean r = conn->sendTable; conn->sendTable = true; return r; }
 
-boolean Webserver::CallPHPBoolean(char* phpRecord)
+boolean Webserver::CallPHPBoolean(int function)
 { 
-  if(StringEquals(phpRecord, "gotPassword("))
+  switch(function)
+  {
+  case GOT_PASSWORD:
     return gotPassword;
     
-  if(StringEquals(phpRecord, "printLinkTable("))
+  case PRINT_LINK_TABLE:
     return PrintLinkTable();
     
-  platform->Message(HOST_MESSAGE, "callPHPBoolean(): non-existent function - ");
-  platform->Message(HOST_MESSAGE, phpRecord);
-  platform->Message(HOST_MESSAGE, "<br>\n");
-  
-  return true; // Best default
+  default:
+    return true; // Best default
+  }
 }
 
 void Webserver::GetGCodeList()
 {
-  platform->SendToClient(platform->FileList(platform->GetGcodeDir()));
+  platform->SendToClient(platform->GCodeList(conn->listOrder, conn->listPage));
 }
 
-void Webserver::CallPHPString(char* phpRecord)
+// Links to the other pages of the list of G Code files, and to the list in each order
+
+void Webserver::GetGCodePages()
 {
-  if(StringEquals(phpRecord, "getMyName("))
+  char* names[GCODE_ORDERS] = { "name", "newest", "size" };
+  int pages = (platform->GCodeCount() + GCODE_LIST_PAGE - 1)/GCODE_LIST_PAGE;
+  int i;
+  if(pages > 1)
   {
+    platform->SendToClient("Page:");
+    for(i = 0; i < pages; i++)
+    {
+      if(i == conn->listPage)
+        snprintf(statusString, STATUS_LENGTH, " %d", i + 1);
+      else
+        snprintf(statusString, STATUS_LENGTH, " <a href=\"?page=%d&sort=%d\">%d</a>", i, conn->listOrder, i + 1);
+      platform->SendToClient(statusString);
+    }
+    platform->SendToClient("&nbsp;&nbsp;&nbsp;");
+  }
+  platform->SendToClient("Sort by:");
+  for(i = 0; i < GCODE_ORDERS; i++)
+  {
+    if(i == conn->listOrder)
+      snprintf(statusString, STATUS_LENGTH, " %s", names[i]);
+    else
+      snprintf(statusString, STATUS_LENGTH, " <a href=\"?sort=%d\">%s</a>", i, names[i]);
+    platform->SendToClient(statusString);
+  }
+}
+
+// Lines waiting, the most there have ever been, and how often the planner has been kept waiting
+
+void Webserver::GetQueueStatus()
+{
+  snprintf(statusString, STATUS_LENGTH, "%d/%d/%lu", queue->Depth(), queue->HighWater(), queue->HungryCount());
+  platform->SendToClient(statusString);
+}
+
+// Percentage of file sectors served from RAM, and bytes read from files per second
+
+void Webserver::GetFileStatus()
+{
+  snprintf(statusString, STATUS_LENGTH, "%d%%/%lu", (int)(100.0*platform->CacheHitRate() + 0.5), platform->FileBytesPerSecond());
+  platform->SendToClient(statusString);
+}
+
+// Messages lost because the log was full, and the last and longest times taken to write it to the file
+
+void Webserver::GetLogStatus()
+{
+  snprintf(statusString, STATUS_LENGTH, "%lu/%lu/%lu", platform->MessagesDropped(), platform->LastFlushTime(), platform->MaxFlushTime());
+  platform->SendToClient(statusString);
+}
+
+// Loop rate, then the longest and 99th percentile times in microseconds for each module
+
+void Webserver::GetTimingStatus()
+{
+  snprintf(statusString, STATUS_LENGTH, "%lu loops/s", reprap.LoopsPerSecond());
+  platform->SendToClient(statusString);
+  for(int i = 0; i < PROFILES; i++)
+  {
+    snprintf(statusString, STATUS_LENGTH, "<br>%s: %lu/%lu", reprap.ProfileName(i), reprap.Longest(i), reprap.Percentile99(i));
+    platform->SendToClient(statusString);
+  }
+}
+
+void Webserver::CallPHPString(int function)
+{
+  switch(function)
+  {
+  case GET_MY_NAME:
     platform->SendToClient(myName);
     return;
-  }
     
-  if(StringEquals(phpRecord, "getGCodeList("))
-  {
+  case GET_GCODE_LIST:
     GetGCodeList();
     return;
-  }  
     
-  if(StringEquals(phpRecord, "logout("))
-  {
+  case GET_QUEUE_STATUS:
+    GetQueueStatus();
+    return;
+    
+  case GET_FILE_STATUS:
+    GetFileStatus();
+    return;
+    
+  case GET_RECENT_MESSAGES:
+    platform->SendLogToClient();
+    return;
+    
+  case GET_LOG_STATUS:
+    GetLogStatus();
+    return;
+    
+  case GET_TIMING_STATUS:
+    GetTimingStatus();
+    return;
+    
+  case GET_GCODE_LENGTHS:
+    platform->SendToClient(platform->GCodeLengths(conn->listOrder, conn->listPage));
+    return;
+    
+  case GET_GCODE_PAGES:
+    GetGCodePages();
+    return;
+    
+  case LOGOUT:
     gotPassword = false;
     platform->SendToClient("<meta http-equiv=\"REFRESH\" content=\"0;url=");
     platform->SendToClient(PASSWORD_PAGE);
     platform->SendToClient("\"></HEAD>");
     return;
-  }
     
-  platform->Message(HOST_MESSAGE, "callPHPString(): non-existent function - ");
+  default:
+    return;
+  }
+}
+
+// Function names are looked up in a hash table, so this is only done once for each call
+// in a page - after that the compiled page has the function's number.
+
+int Webserver::PHPFunction(char* phpRecord)
+{
+  unsigned long h = platform->NameHash(phpRecord);
+  int i = h & (PHP_DISPATCH - 1);
+  int f;
+  while((f = phpDispatch[i]) >= 0)
+  {
+    if(phpFunctionHashes[f] == h && StringEquals(phpRecord, phpFunctionNames[f]))
+      return f;
+    i = (i + 1) & (PHP_DISPATCH - 1);
+  }
+  platform->Message(HOST_MESSAGE, "PHP: non-existent function - ");
   platform->Message(HOST_MESSAGE, phpRecord);
-  platform->Message(HOST_MESSAGE, "<br>\n"); 
+  platform->Message(HOST_MESSAGE, "<br>\n");
+  return -1;
+}
+
+// Use the compiled version of a page if it is still up to date; otherwise get ready to
+// compile it in the least recently used slot as it is interpreted.
+
+void Webserver::FindTemplate(char* fileName)
+{
+  unsigned long h = platform->NameHash(fileName);
+  unsigned long changes = platform->FileChanges(fileName);
+  unsigned long length = platform->Length(conn->fileBeingSent);
+  templateClock++;
+  conn->phpIfOp = -1;
+  conn->phpOffset = 0;
+  conn->opIndex = 0;
+  conn->spanDone = 0;
+  
+  int oldest = -1;
+  for(int i = 0; i < PHP_TEMPLATES; i++)
+  {
+    PHPTemplate* t = &templates[i];
+    if(t->valid && t->nameHash == h && t->fileLength == length && t->fileChanges == changes)
+    {
+      t->lastUsed = templateClock;
+      t->users++;
+      conn->phpTemplate = i;
+      conn->recording = false;
+      conn->runningTemplate = true;
+      return;
+    }
+    if(!t->users && (oldest < 0 || t->lastUsed < templates[oldest].lastUsed))
+      oldest = i;
+  }
+  
+  // If every slot is in use by other connections the page just gets interpreted
+  
+  conn->runningTemplate = false;
+  conn->recording = false;
+  conn->phpTemplate = oldest;
+  if(oldest < 0)
+    return;
+  PHPTemplate* t = &templates[oldest];
+  t->valid = false;
+  t->nameHash = h;
+  t->fileLength = length;
+  t->fileChanges = changes;
+  t->lastUsed = templateClock;
+  t->opCount = 0;
+  t->users++;
+  conn->recording = true;
+}
+
+void Webserver::ReleaseTemplate()
+{
+  if(conn->phpTemplate < 0)
+    return;
+  templates[conn->phpTemplate].users--;
+  conn->phpTemplate = -1;
+  conn->recording = false;
+  conn->runningTemplate = false;
+}
+
+void Webserver::RecordOp(byte type, unsigned long start, int length)
+{
+  if(!conn->recording)
+    return;
+  PHPTemplate* t = &templates[conn->phpTemplate];
+  
+  if(type == PHP_ECHO && conn->phpIfOp < 0)
+    type = PHP_TEXT;
+  if(type != PHP_ECHO)
+    conn->phpIfOp = -1;
+  
+  // Text straight after the last lot is added to it
+  
+  if((type == PHP_TEXT || type == PHP_ECHO) && t->opCount > 0)
+  {
+    int last = t->opCount - 1;
+    if(t->opType[last] == type && t->opStart[last] + t->opLength[last] == start)
+    {
+      t->opLength[last] += length;
+      return;
+    }
+  }
+  
+  if(t->opCount >= PHP_OPS)
+  {
+    conn->recording = false; // Too big - it will be interpreted next time as well
+    return;
+  }
+  if(type == PHP_ECHO)
+    t->opLength[conn->phpIfOp]++;
+  if(type == PHP_IF)
+    conn->phpIfOp = t->opCount;
+  t->opType[t->opCount] = type;
+  t->opStart[t->opCount] = start;
+  t->opLength[t->opCount] = length;
+  t->opCount++;
+}
+
+// Send the last length bytes interpreted (which are in s) and add them to the page
+// being compiled.  Echoed text is only sent if the if before it was true.
+
+void Webserver::PHPText(char* s, int length, boolean echo)
+{
+  if(!echo || conn->ifWasTrue)
+    platform->SendToClient(s, length);
+  RecordOp(echo ? PHP_ECHO : PHP_TEXT, conn->phpOffset + 1 - length, length);
+}
+
+// Serve a compiled page: spans of text are copied from the file in bulk, and functions are
+// called directly.
+
+void Webserver::RunTemplate()
+{
+  PHPTemplate* t = &templates[conn->phpTemplate];
+  int budget = WEB_SPIN_BYTES;
+  int n;
+  while(budget > 0 && conn->opIndex < t->opCount)
+  {
+    switch(t->opType[conn->opIndex])
+    {
+    case PHP_TEXT:
+    case PHP_ECHO:
+      n = t->opLength[conn->opIndex] - conn->spanDone;
+      if(n > budget)
+        n = budget;
+      platform->Seek(conn->fileBeingSent, t->opStart[conn->opIndex] + conn->spanDone);
+      n = platform->Read(conn->fileBeingSent, sendBuffer, n);
+      if(n <= 0)
+      {
+        conn->opIndex = t->opCount; // The file has gone wrong
+        break;
+      }
+      platform->SendToClient(sendBuffer, n);
+      budget -= n;
+      conn->spanDone += n;
+      if(conn->spanDone >= t->opLength[conn->opIndex])
+      {
+        conn->opIndex++;
+        conn->spanDone = 0;
+      }
+      break;
+      
+    case PHP_IF:
+      if(CallPHPBoolean(t->opStart[conn->opIndex]))
+        conn->opIndex++;
+      else
+        conn->opIndex += 1 + t->opLength[conn->opIndex];
+      break;
+      
+    case PHP_PRINT:
+      CallPHPString(t->opStart[conn->opIndex]);
+      conn->opIndex++;
+      break;
+      
+    default:
+      conn->opIndex++;
+    }
+  }
+  
+  if(conn->opIndex >= t->opCount)
+  {
+    platform->Close(conn->fileBeingSent);
+    InitialisePHP();
+    CloseClient();
+  }
 }
 
 void Webserver::ProcessPHPByte(char b)
 {
-  if(eatInput)
+  if(conn->eatInput)
   {
-    if(b == eatInputChar)  
-      eatInput = false;
+    if(b == conn->eatInputChar)  
+      conn->eatInput = false;
     return;
   }
   
-  if(recordInput)
+  if(conn->recordInput)
   {
-    if(b == eatInputChar)
+    if(b == conn->eatInputChar)
     {
-      recordInput = false;
-      phpRecordPointer = 0;
+      conn->recordInput = false;
+      conn->phpRecordPointer = 0;
       return;
     }
     
-    phpRecord[phpRecordPointer++] = b;
-    if(phpRecordPointer >= PHP_TAG_LENGTH)
+    conn->phpRecord[conn->phpRecordPointer++] = b;
+    if(conn->phpRecordPointer >= PHP_TAG_LENGTH)
     {
       platform->Message(HOST_MESSAGE, "ProcessPHPByte: PHP record buffer overflow.<br>\n");
       InitialisePHP();
     }
-    phpRecord[phpRecordPointer] = 0;
+    conn->phpRecord[conn->phpRecordPointer] = 0;
     return;
   }
   
-  if(phpEchoing)
+  if(conn->phpEchoing)
   {
      if(b != '\'')
+       PHPText(&b, 1, true);
+     else
      {
-       if(ifWasTrue)
-         platform->SendToClient(b);
-     } else
-     {
+       conn->phpIfOp = -1; // Only the echo straight after an if depends on it
        InitialisePHP();
-       eatInput = true;
-       eatInputChar = '>';
+       conn->eatInput = true;
+       conn->eatInputChar = '>';
      }
      return;
   }
   
-  if(phpIfing)
+  if(conn->phpIfing)
   {
-    boolean ifWas = CallPHPBoolean(phpRecord);
+    int function = PHPFunction(conn->phpRecord);
+    RecordOp(PHP_IF, function, 0);
+    boolean ifWas = CallPHPBoolean(function);
     InitialisePHP();
-    ifWasTrue = ifWas;
-    inPHPString = 5;
+    conn->ifWasTrue = ifWas;
+    conn->inPHPString = 5;
     if(b != ')')
     {
-      eatInput = true;
-      eatInputChar = ')';
+      conn->eatInput = true;
+      conn->eatInputChar = ')';
     }
     return;
   }
   
-  if(phpPrinting)
+  if(conn->phpPrinting)
   {
-    CallPHPString(phpRecord);
+    int function = PHPFunction(conn->phpRecord);
+    RecordOp(PHP_PRINT, function, 0);
+    CallPHPString(function);
     InitialisePHP();
-    eatInput = true;
-    eatInputChar = '>';    
+    conn->eatInput = true;
+    conn->eatInputChar = '>';    
     return;
   }  
   
-  if(inPHPString >= 5)
+  if(conn->inPHPString >= 5)
   {
   // We are in a PHP expression
   
     if(isspace(b))
       return;    
-    phpTag[phpPointer++] = b;
-    phpTag[phpPointer] = 0;
-    if(phpPointer >= PHP_TAG_LENGTH)
+    conn->phpTag[conn->phpPointer++] = b;
+    conn->phpTag[conn->phpPointer] = 0;
+    if(conn->phpPointer >= PHP_TAG_LENGTH)
     {
       platform->Message(HOST_MESSAGE, "ProcessPHPByte: PHP buffer overflow: ");
-      platform->Message(HOST_MESSAGE, phpTag);
+      platform->Message(HOST_MESSAGE, conn->phpTag);
       platform->Message(HOST_MESSAGE, "<br>\n");
       InitialisePHP();
       return;
     }
     
-    switch(PHPParse(phpTag))
+    switch(PHPParse(conn->phpTag))
     {
     case PHP_ECHO:
-      phpEchoing = true;
-      eatInput = true;
-      eatInputChar = '\'';
+      conn->phpEchoing = true;
+      conn->eatInput = true;
+      conn->eatInputChar = '\'';
       break;
       
     case PHP_IF:
-      phpIfing = true;
-      recordInput = true;
-      phpRecordPointer = 0;
-      phpRecord[phpRecordPointer] = 0;
-      eatInputChar = ')';
+      conn->phpIfing = true;
+      conn->recordInput = true;
+      conn->phpRecordPointer = 0;
+      conn->phpRecord[conn->phpRecordPointer] = 0;
+      conn->eatInputChar = ')';
       break;
     
     case PHP_PRINT:
-      phpPrinting = true;
-      recordInput = true;
-      phpRecordPointer = 0;
-      phpRecord[phpRecordPointer] = 0;
-      eatInputChar = ')';
+      conn->phpPrinting = true;
+      conn->recordInput = true;
+      conn->phpRecordPointer = 0;
+      conn->phpRecord[conn->phpRecordPointer] = 0;
+      conn->eatInputChar = ')';
       break;     
      
     default:
@@ -773,69 +1391,64 @@ void Webserver::ProcessPHPByte(char b)
   
   // We are not in a PHP expression
   
-  phpTag[inPHPString] = b;
+  conn->phpTag[conn->inPHPString] = b;
   
-  switch(inPHPString)
+  switch(conn->inPHPString)
   {
   case 0:
     if(b == '<')
     {
-      inPHPString = 1;
+      conn->inPHPString = 1;
     } else
     {
-      phpTag[1] = 0;
-      inPHPString = 0;
-      platform->SendToClient(phpTag); 
+      conn->inPHPString = 0;
+      PHPText(conn->phpTag, 1, false);
     }       
     return;
     
   case 1:
     if(b == '?')
     {
-      inPHPString = 2;
+      conn->inPHPString = 2;
     } else
     {
-      phpTag[2] = 0;
-      inPHPString = 0;
-      platform->SendToClient(phpTag); 
+      conn->inPHPString = 0;
+      PHPText(conn->phpTag, 2, false);
     }
     return;
     
   case 2:
     if(b == 'p')
     {
-      inPHPString = 3;
+      conn->inPHPString = 3;
     } else
     {
-      phpTag[3] = 0;
-      inPHPString = 0;
-      platform->SendToClient(phpTag); 
+      conn->inPHPString = 0;
+      PHPText(conn->phpTag, 3, false);
     }
     return;  
   
   case 3:
     if(b == 'h')
     {
-      inPHPString = 4;
+      conn->inPHPString = 4;
     } else
     {
-      phpTag[4] = 0;
-      inPHPString = 0;
-      platform->SendToClient(phpTag); 
+      conn->inPHPString = 0;
+      PHPText(conn->phpTag, 4, false);
     }
     return;
 
   case 4:
     if(b == 'p')
     {
-      inPHPString = 5;
-      phpTag[0] = 0;
-      phpPointer = 0;
+      conn->inPHPString = 5;
+      conn->phpTag[0] = 0;
+      conn->phpPointer = 0;
     } else
     {
-      phpTag[5] = 0;
-      inPHPString = 0;
-      platform->SendToClient(phpTag); 
+      conn->inPHPString = 0;
+      PHPText(conn->phpTag, 5, false);
     }
     return;
   
@@ -843,19 +1456,31 @@ void Webserver::ProcessPHPByte(char b)
   
   default:
      platform->Message(HOST_MESSAGE, "ProcessPHPByte: PHP tag runout.<br>\n");
-     platform->SendToClient(b);
+     PHPText(&b, 1, false);
      InitialisePHP();
   }   
 }
 
-void Webserver::WritePHPByte()
+void Webserver::WritePHPBytes()
 {
-    unsigned char b;
-    if(platform->Read(fileBeingSent, b))
-      ProcessPHPByte(b);
-    else
+    if(conn->runningTemplate)
+    {
+      RunTemplate();
+      return;
+    }
+    
+    int n = platform->Read(conn->fileBeingSent, sendBuffer, WEB_SPIN_BYTES);
+    for(int i = 0; i < n; i++)
+    {
+      ProcessPHPByte(sendBuffer[i]);
+      conn->phpOffset++;
+    }
+    if(n < WEB_SPIN_BYTES)
     {     
-      platform->Close(fileBeingSent);
+      if(conn->recording)
+        templates[conn->phpTemplate].valid = true;
+      conn->recording = false;
+      platform->Close(conn->fileBeingSent);
       InitialisePHP();    
       CloseClient(); 
     }  
@@ -865,39 +1490,105 @@ void Webserver::WritePHPByte()
 
 // Constructor and initialisation
 
-Webserver::Webserver(Platform* p)
+Webserver::Webserver(Platform* p, CommandQueue* q)
 {
   //Serial.println("Webserver constructor"); 
   platform = p;
+  queue = q;
   active = false;
 }
 
 void Webserver::Init()
 {
   lastTime = platform->Time();
-  writing = false;
-  receivingPost = false;
-  postSeen = false;
-  getSeen = false;
-  //postLength = 0L;
-  inPHPFile = false;
-  InitialisePHP();
-  clientLineIsBlank = true;
-  needToCloseClient = false;
-  clientLinePointer = 0;
-  clientLine[0] = 0;
-  clientRequest[0] = 0;
   password = DEFAULT_PASSWORD;
   myName = DEFAULT_NAME;
   gotPassword = false;
-  gcodeAvailable = false;
   gcodePointer = 0;
-  sendTable = true;
-  phpRecordPointer = 0;
-  InitialisePost();
+  
+  char* names[PHP_FUNCTIONS] = PHP_FUNCTION_NAMES;
+  int i, j;
+  for(i = 0; i < PHP_DISPATCH; i++)
+    phpDispatch[i] = -1;
+  for(i = 0; i < PHP_FUNCTIONS; i++)
+  {
+    phpFunctionNames[i] = names[i];
+    phpFunctionHashes[i] = platform->NameHash(names[i]);
+    j = phpFunctionHashes[i] & (PHP_DISPATCH - 1);
+    while(phpDispatch[j] >= 0)
+      j = (j + 1) & (PHP_DISPATCH - 1);
+    phpDispatch[j] = i;
+  }
+  templateClock = 0;
+  sidecar.Init(platform);
+  sidecarConnection = 0;
+  
+  for(i = 0; i < HTTP_CONNECTIONS; i++)
+  {
+    conn = &connections[i];
+    InitialiseConnection();
+  }
   active = true; 
 }
 
+// Get a connection ready for a new client
+
+void Webserver::InitialiseConnection()
+{
+  conn->open = false;
+  conn->keepAlive = false;
+  conn->lastActivity = platform->Time();
+  conn->inPointer = 0;
+  conn->inLength = 0;
+  conn->fileBeingSent = -1;
+  conn->writing = false;
+  conn->getSeen = false;
+  //postLength = 0L;
+  conn->inPHPFile = false;
+  InitialisePHP();
+  conn->clientLineIsBlank = true;
+  conn->needToCloseClient = false;
+  conn->clientLinePointer = 0;
+  conn->clientLine[0] = 0;
+  conn->clientRequest[0] = 0;
+  conn->clientQualifier[0] = 0;
+  conn->sendTable = true;
+  conn->phpTemplate = -1;
+  conn->recording = false;
+  conn->runningTemplate = false;
+  InitialisePost();
+}
+
+// The client has gone away in the middle of something
+
+void Webserver::AbandonConnection()
+{
+  if(conn->writing)
+    platform->Close(conn->fileBeingSent);
+  if(conn->postFile >= 0)
+    platform->Close(conn->postFile);
+  if(sidecarConnection == conn)
+    sidecarConnection = 0;
+  ReleaseTemplate();
+  InitialiseConnection();
+}
+
+HttpConnection::HttpConnection()
+{
+  open = false;
+  writing = false;
+  postFile = -1;
+  phpTemplate = -1;
+}
+
+PHPTemplate::PHPTemplate()
+{
+  valid = false;
+  users = 0;
+  lastUsed = 0;
+  opCount = 0;
+}
+
 void Webserver::Exit()
 {
   active = false;